@@ -1,4 +1,6 @@
-del gld.exe fsd.exe term.exe
+del gld.exe fsd.exe term.exe prof.exe emp.exe
 gcc -o gld -O3 -m32 mingw/gld.c -lwsock32 -lgdi32
 gcc -o fsd -O3 -m32 mingw/fsd.c -lwsock32
 gcc -o term -O3 -m32 -Imingw -Iroot/lib root/bin/term.c
+gcc -o prof -O3 -m32 -Imingw -Iroot/lib root/bin/prof.c
+gcc -o emp -O3 -m32 -DHIST -Imingw -Iroot/lib root/bin/em.c
@@ -1,5 +1,7 @@
 #!/bin/sh
-rm -f gld fsd term
+rm -f gld fsd term prof xemp
 gcc -o gld -O3 -m32 linux/gld.c -lX11 -lGL
-#gcc -o fsd -O3 -m32 linux/fsd.c
+gcc -o fsd -O3 -m32 -Ilinux -Iroot/lib root/bin/fsd.c
 gcc -o term -O3 -m32 -Ilinux -Iroot/lib root/bin/term.c
+gcc -o prof -O3 -m32 -Ilinux -Iroot/lib root/bin/prof.c
+gcc -o xemp -O3 -m32 -DHIST -Ilinux -Iroot/lib root/bin/em.c -lm
@@ -1,4 +1,4 @@
-del c.exe em.exe eu.exe mkfs.exe gld.exe fsd.exe term.exe c em eu
+del c.exe em.exe eu.exe mkfs.exe gld.exe fsd.exe term.exe prof.exe emp.exe c em eu
 del hello.exe hello emhello euhello hello.txt emhello.txt euhello.txt c em eu
 del os0 os1 os2 os3
-del fs.img root\bin\c root\etc\os root\etc\sfs.img
+del fs.img root\bin\c root\etc\os root\etc\sfs.img root\lib\libc.o
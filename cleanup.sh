@@ -1,5 +1,5 @@
 #!/bin/sh
-rm -f xc xem xeu xmkfs gld fsd term
+rm -f xc xem xeu xmkfs gld fsd term prof xemp
 rm -f xhello hello emhello euhello hello.txt emhello.txt euhello.txt c em eu
 rm -f os0 os1 os2 os3
-rm -f fs.img root/bin/c root/etc/os root/etc/sfs.img
+rm -f fs.img root/bin/c root/etc/os root/etc/sfs.img root/lib/libc.o
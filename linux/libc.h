@@ -13,7 +13,8 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
-#define NOFILE 16 // XXX subject to change
+#define NOFILE 512 // fsd alone holds NCLIENT * NFH files plus its sockets, select() bounds it by FD_SETSIZE
+#define LINUX  1   // for the few programs that can use more of the host than the guest offers
 
 #undef NAME_MAX
 #undef PATH_MAX
@@ -144,6 +145,12 @@ int xfstat(int d, struct xstat *s)
   }
   return r;
 }
+uint xmtime(int d) // host modification time of an open file, zero if unknown
+{
+  struct stat hs;
+  if ((uint)d >= NOFILE || xft[d] != xFILE || fstat(xfd[d], &hs)) return 0;
+  return hs.st_mtime;
+}
 int xstat(char *file, struct xstat *s)
 {
   struct stat hs; int r;
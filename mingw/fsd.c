@@ -1,9 +1,13 @@
 // fsd -- win32 file server daemon
+//
+// Usage:  fsd [-v] [-d] [-p port]
+//
+// Serves every client from one select() loop, see root/bin/fsd.c for the protocol.
 
 #define WIN32_LEAN_AND_MEAN
 #include <winsock2.h>
 #include <windows.h>
-#include <process.h>
+#include <io.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -12,22 +16,24 @@
 
 #define NAME_MAX 256
 
-enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_SEEK, M_FSTAT, M_SYNC };
+enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_FSTAT, M_SYNC };
 
 // M_LINK, M_UNLINK, M_MKDIR
 
+enum {
+  NCLIENT = 8,        // connections
+  NFH     = 32,       // file handles per client
+  IBUF    = 8192,     // request buffer per client, holds a header and a path
+  OBUF    = 64*1024,  // reply buffer, bounds a single read
+};
+
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
 
 int debug;
 int verbose;
-int sync; // XXX
 
-int sd = -1;
-int fd = -1;
-DIR *dir;
-char *s;
 struct xstat {
   ushort st_dev;   // device number
   ushort st_mode;  // type of file
@@ -35,6 +41,19 @@ struct xstat {
   uint   st_nlink; // number of links to file
   uint   st_size;  // size of file in bytes
 };
+struct rattr { struct xstat st; uint mtime; };
+
+struct client {
+  SOCKET sd;                        // INVALID_SOCKET if free
+  struct { int fd; DIR *dir; } fh[NFH];
+  int h[5];                         // request being received
+  int need;                         // M_WRITE payload still to come
+  int r;                            // M_WRITE result so far
+  int n;                            // bytes buffered
+  char in[IBUF];
+} client[NCLIENT];
+
+char out[OBUF]; // reply header followed by its data
 
 void fatal(char *s)
 {
@@ -42,213 +61,199 @@ void fatal(char *s)
   exit(-1);
 }
 
-void tx(void *p, uint n)
+void drop(struct client *c)
 {
-  int r;
-  while (n) {
-    if ((r = send(sd, p, n, 0)) <= 0) fatal("tx()");
-    n -= r;
-    p += r; 
+  int i;
+  if (verbose) printf("Connection closed\n");
+  for (i = 0; i < NFH; i++) {
+    if (c->fh[i].dir) { closedir(c->fh[i].dir); c->fh[i].dir = 0; }
+    if (c->fh[i].fd >= 0) { close(c->fh[i].fd); c->fh[i].fd = -1; }
   }
+  closesocket(c->sd);
+  c->sd = INVALID_SOCKET;
 }
 
-void rx(void *p, int n)
+// send the header and the n bytes of data already placed behind it in one send
+int reply(struct client *c, int r, int n)
 {
-  int r;
-  while (n) {
-    if ((r = recv(sd, p, n, 0)) <= 0) { if (verbose) printf("Connection closed\n"); exit(0); }
-    n -= r;
-    p += r; 
-  }
+  int *h = (int *)out; char *p = out;
+  h[0] = c->h[1]; h[1] = r; h[2] = n;
+  for (n += 12; n > 0; n -= r, p += r)
+    if ((r = send(c->sd, p, n, 0)) <= 0) { drop(c); return -1; }
+  return 0;
 }
 
-ssize(int n)
+// open flags arrive in the guest's encoding
+int oflags(int f)
 {
-  static int sn = 0;
-  n = (n + 4095) & -4096;
-  if (n > sn) {
-    sn = n;
-    if (s) free(s);
-    s = malloc(n);
-    if (!s) fatal("ssize() malloc");
-  }
+  return (f & 3) | ((f & 0x100) ? O_CREAT : 0) | ((f & 0x200) ? O_TRUNC : 0);
 }
 
-void rxmsgs(void)
+int attr(struct client *c, int i, struct rattr *a)
 {
-  int h[3], n, r; struct stat hs; struct xstat xs;
-  struct dirent *de;
-  
-  for (;;) {
-    rx(&n,4);
-    switch (n) {
-    case M_OPEN:
-      if (fd >= 0 || dir) fatal("open");
-      rx(h,12); ssize(h[2]);
-      rx(s,h[2]);
-//      sync = (h[0] & O_SYNC);
-      sync = 0;
-      if (!(h[0] & O_CREAT) && !stat(s, &hs) && S_ISDIR(hs.st_mode)) {
-        r = (dir = opendir(s)) ? 0 : -1;
-        if (debug) printf("%d = opendir(%s)\n",r,s);
-      } else {
-        h[1] = S_IRWXU; // XXX
-        fd = open(s, h[0] | O_BINARY, h[1]); // XXX third arg?
-        if (debug) printf("%d = open(%s, %d, %d)\n",fd,s,h[0],h[1]);
-        r = (fd >= 0) ? 0 : -1;
+  struct stat hs;
+  memset(a, 0, sizeof(struct rattr));
+  if (c->fh[i].dir) { a->st.st_mode = S_IFDIR; return 0; }
+  if (fstat(c->fh[i].fd, &hs)) return -1;
+  a->st.st_mode  = hs.st_mode;
+  a->st.st_dev   = hs.st_dev;
+  a->st.st_ino   = hs.st_ino;
+  a->st.st_nlink = hs.st_nlink;
+  a->st.st_size  = hs.st_size;
+  a->mtime       = hs.st_mtime;
+  return 0;
+}
+
+// carry out a request whose header (and path) has arrived
+int request(struct client *c, char *path)
+{
+  int *h = c->h, i, r, n, one = 1; struct stat hs; struct dirent *de;
+
+  i = h[2];
+  if (h[0] != M_OPEN && ((uint)i >= NFH || (c->fh[i].fd < 0 && !c->fh[i].dir))) {
+    if (debug) printf("bad handle %d\n", i);
+    if (h[0] == M_WRITE) { c->need = h[4]; c->r = -1; return c->need ? 0 : reply(c, -1, 0); }
+    return reply(c, -1, 0);
+  }
+  switch (h[0]) {
+  case M_OPEN:
+    for (i = 0; i < NFH && (c->fh[i].fd >= 0 || c->fh[i].dir); i++) ;
+    if (i == NFH) r = -1;
+    else if (!(h[3] & 0x100) && !stat(path, &hs) && S_ISDIR(hs.st_mode)) {
+      r = (c->fh[i].dir = opendir(path)) ? 0 : -1;
+      if (debug) printf("%d = opendir(%s)\n", r, path);
+    } else {
+      r = c->fh[i].fd = open(path, oflags(h[3]) | O_BINARY, S_IRWXU);
+      if (debug) printf("%d = open(%s, %d)\n", r, path, h[3]);
+    }
+    if (r < 0) return reply(c, -1, 0);
+    if (attr(c, i, (struct rattr *)(out + 12))) {
+      if (c->fh[i].dir) { closedir(c->fh[i].dir); c->fh[i].dir = 0; } else { close(c->fh[i].fd); c->fh[i].fd = -1; }
+      return reply(c, -1, 0);
+    }
+    return reply(c, i, sizeof(struct rattr));
+  case M_CLOSE:
+    if (c->fh[i].dir) { closedir(c->fh[i].dir); c->fh[i].dir = 0; r = 0; }
+    else { r = close(c->fh[i].fd); c->fh[i].fd = -1; }
+    if (debug) printf("%d = close(%d)\n", r, i);
+    return reply(c, r, 0);
+  case M_READ:
+    if ((n = h[4]) > OBUF - 12) n = OBUF - 12;
+    if (c->fh[i].dir) { // offsets are ignored, one record per NAME_MAX bytes
+      for (r = 0; r + NAME_MAX <= n && (de = readdir(c->fh[i].dir)); r += NAME_MAX) {
+        memcpy(out + 12 + r, &one, 4);
+        strncpy(out + 12 + r + 4, de->d_name, NAME_MAX - 4);
       }
-      tx(&r,4);
-      break;
-    case M_CLOSE:
-      if (fd >= 0) {
-        close(fd);
-        if (debug) printf("close(%d)\n",fd);
-        fd = -1;
-      } else if (dir) {
-        closedir(dir);
-        if (debug) printf("closedir()\n");
-        dir = 0;
-      } else fatal("close");
-      break;
-    case M_READ:
-      if (fd >= 0) {
-        rx(&n,4); ssize(n);
-        r = read(fd, s, n);
-        if (debug) printf("%d = read(%d, s, %d)\n", r, fd, n);
-        tx(&r,4);
-        if ((uint)r <= n) tx(s, r);
-      } else if (dir) {
-        rx(&n,4); ssize(n);
-        r = 0;
-        if (n == NAME_MAX && (de = readdir(dir))) {
-          r = 1; memcpy(s, &r, 4);
-          strncpy(s + 4, de->d_name, NAME_MAX - 4);
-          r = NAME_MAX;
-        }
-        if (debug) printf("%d = readdir(%d)\n", r, n);
-        tx(&r,4);
-        if ((uint)r <= n) tx(s, r);
-      } else fatal("read");
-      break;
-    case M_WRITE:
-      if (fd < 0) fatal("write");
-      rx(&n,4); ssize(n);
-      if (n > 0) rx(s, n);
-      r = write(fd, s, n);
-      if (debug) printf("%d = write(%d, s, %d)\n", r, fd, n);
-      if (sync) tx(&r,4);
-      break;
-    case M_SEEK:
-      if (fd < 0) fatal("lseek");
-      rx(h,8);
-      r = lseek(fd, h[0], h[1]);
-      if (debug) printf("%d = lseek(%d, %d, %d)\n", r, fd, h[0], h[1]);
-      tx(&r,4);
-      break;
-    case M_FSTAT:
-      if (fd >= 0) {
-        r = fstat(fd, &hs);
-        if (debug) printf("%d = fstat(%d, sp)\n", r, fd);
-        tx(&r,4);
-        if (r == 0) {
-          xs.st_mode  = hs.st_mode;
-          xs.st_dev   = hs.st_dev;
-          xs.st_ino   = hs.st_ino;
-          xs.st_nlink = hs.st_nlink;
-          xs.st_size  = hs.st_size;
-          tx(&xs, sizeof(xs));
-        }
-      } else if (dir) {
-        r = 0;
-        if (debug) printf("%d = fstat(dir)\n", r);
-        tx(&r,4);
-        xs.st_mode  = S_IFDIR;
-        xs.st_dev   = 0;
-        xs.st_ino   = 0;
-        xs.st_nlink = 0;
-        xs.st_size  = 0;
-        tx(&xs, sizeof(xs));
-      } else fatal("fstat");
-      break;
-    case M_SYNC:
-      if (fd < 0) fatal("fsync");
-//      r = fsync(fd);  // XXX does win32 have this?
-      if (debug) printf("%d = fsync(%d)\n", r, fd);
-      tx(&r,4);
-      break;
-    default:
-      fatal("bad message");
+      if (debug) printf("%d = readdir(%d)\n", r, n);
+    } else {
+      lseek(c->fh[i].fd, h[3], SEEK_SET);
+      r = read(c->fh[i].fd, out + 12, n);
+      if (debug) printf("%d = read(%d, s, %d) @ %d\n", r, i, n, h[3]);
     }
+    return reply(c, r, r > 0 ? r : 0);
+  case M_WRITE: // the payload is written as it arrives
+    c->need = h[4];
+    c->r = (!c->fh[i].dir && lseek(c->fh[i].fd, h[3], SEEK_SET) >= 0) ? 0 : -1;
+    return c->need ? 0 : reply(c, c->r, 0);
+  case M_FSTAT:
+    r = attr(c, i, (struct rattr *)(out + 12));
+    if (debug) printf("%d = fstat(%d, sp)\n", r, i);
+    return reply(c, r, r ? 0 : sizeof(struct rattr));
+  case M_SYNC:
+    r = c->fh[i].dir ? 0 : _commit(c->fh[i].fd);
+    if (debug) printf("%d = fsync(%d)\n", r, i);
+    return reply(c, r, 0);
   }
+  if (verbose) printf("bad message %d\n", h[0]);
+  drop(c);
+  return -1;
+}
+
+// work through everything buffered for a client
+void serve(struct client *c)
+{
+  int m, fd; char *p = c->in, *e = c->in + c->n;
+
+  while (c->sd != INVALID_SOCKET) {
+    m = e - p;
+    if (c->need) { // M_WRITE payload
+      if (!m) break;
+      if (m > c->need) m = c->need;
+      if (c->r >= 0 && (fd = c->fh[c->h[2]].fd) >= 0 && write(fd, p, m) == m) c->r += m; else c->r = -1;
+      if (debug) printf("%d = write(%d, s, %d)\n", c->r, c->h[2], m);
+      p += m;
+      if (!(c->need -= m)) reply(c, c->r, 0);
+      continue;
+    }
+    if (m < 20) break;
+    memcpy(c->h, p, 20);
+    if (c->h[0] == M_OPEN) {
+      if ((uint)c->h[4] - 1 >= IBUF - 20) { if (verbose) printf("bad path length\n"); drop(c); return; }
+      if (m < 20 + c->h[4]) break;
+      p[20 + c->h[4] - 1] = 0;
+      p += 20 + c->h[4];
+      request(c, p - c->h[4]);
+    } else {
+      p += 20;
+      request(c, 0);
+    }
+  }
+  if (c->sd == INVALID_SOCKET) return;
+  memmove(c->in, p, c->n = e - p);
 }
 
 int main(int argc, char *argv[])
 {
-  WSADATA info; int i, ld;
-  char cmdline[256];
-  PROCESS_INFORMATION pi;
-  STARTUPINFO si;
+  WSADATA info; int i, n, nc; SOCKET ld, sd;
+  struct client *c;
   struct sockaddr_in addr;
+  fd_set rd;
   int port = 5003;
-  int server = 1;
 
   if (WSAStartup(MAKEWORD(2,0),&info) != 0) fatal("WSAStartup()");
 
   for (i=1; i<argc; i++) {
     if (!strcmp(argv[i],"-v")) verbose = 1; else
-    if (!strcmp(argv[i],"-I")) server = 0; else
     if (!strcmp(argv[i],"-d")) debug = verbose = 1; else
     if (!strcmp(argv[i],"-p") && i+1 < argc) port = atoi(argv[++i]); else
     fatal("usage: fsrv [-v] [-d] [-p port]");
   }
-  
-  if (server) {
-    if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0) fatal("socket()");
-    i = 1; setsockopt(ld, SOL_SOCKET, SO_REUSEADDR, (const char *) &i, sizeof(i));
-    ZeroMemory(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(ld, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) < 0) { closesocket(ld); fatal("bind()"); }
-    if (listen(ld, 1) < 0) { closesocket(ld); fatal("listen()"); }
-
-    if (verbose) printf("Listening on port %d...\n", port) ;
-    for (;;) {
-      if ((sd = accept(ld, 0, 0)) < 0) fatal("accept()");
+
+  for (c = client; c < &client[NCLIENT]; c++) c->sd = INVALID_SOCKET;
+
+  if ((ld = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) fatal("socket()");
+  i = 1; setsockopt(ld, SOL_SOCKET, SO_REUSEADDR, (const char *) &i, sizeof(i));
+  ZeroMemory(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(ld, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) < 0) { closesocket(ld); fatal("bind()"); }
+  if (listen(ld, NCLIENT) < 0) { closesocket(ld); fatal("listen()"); }
+
+  if (verbose) printf("Listening on port %d...\n", port) ;
+  for (;;) {
+    FD_ZERO(&rd);
+    for (nc = 0, c = client; c < &client[NCLIENT]; c++)
+      if (c->sd != INVALID_SOCKET) { FD_SET(c->sd, &rd); nc++; }
+    if (nc < NCLIENT) FD_SET(ld, &rd); // leave new clients queued while full
+
+    if (select(0, &rd, 0, 0, 0) == SOCKET_ERROR) fatal("select()");
+
+    for (c = client; c < &client[NCLIENT]; c++) {
+      if (c->sd == INVALID_SOCKET || !FD_ISSET(c->sd, &rd)) continue;
+      if ((n = recv(c->sd, c->in + c->n, IBUF - c->n, 0)) <= 0) { drop(c); continue; }
+      c->n += n;
+      serve(c);
+    }
+
+    if (nc < NCLIENT && FD_ISSET(ld, &rd)) {
+      if ((sd = accept(ld, 0, 0)) == INVALID_SOCKET) fatal("accept()");
       if (verbose) printf("Connection accepted\n") ;
-      i = 1; setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (const char *) &i, sizeof(i));
-      
-      strcpy(cmdline, argv[0]);
-      strcat(cmdline, " -I");
-      if (debug) strcat(cmdline, " -d");
-      if (verbose) strcat(cmdline, " -v");
-            
-      memset(&si, 0 , sizeof(STARTUPINFO));
-      si.cb = sizeof(STARTUPINFO);
-      si.hStdInput = (HANDLE)sd;
-      si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-      si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-      si.dwFlags = STARTF_USESTDHANDLES;
-      
-      if (!CreateProcess(NULL, // application name
-          cmdline, // command line
-          NULL,    // process security attributes
-          NULL,    // thread security attributes
-          TRUE,    // inherit handles
-          0,       // creation flags
-          NULL,    // environment
-          NULL,    // current directory
-          &si,     // startup info
-          &pi)) fatal("CreateProcess()");
-
-      CloseHandle(pi.hThread);
-      CloseHandle(pi.hProcess);
-
-      closesocket(sd);      
+      for (c = client; c->sd != INVALID_SOCKET; c++) ;
+      c->sd = sd;
+      c->n = c->need = 0;
+      for (i = 0; i < NFH; i++) { c->fh[i].fd = -1; c->fh[i].dir = 0; }
     }
-  } else {
-    sd = (SOCKET) GetStdHandle(STD_INPUT_HANDLE);
-    rxmsgs();
   }
   return 0;
 }
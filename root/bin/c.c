@@ -1,19 +1,38 @@
 // c -- c compiler
 //
-// Usage:  c [-v] [-s] [-Ipath] [-o exefile] file ...
+// Usage:  c [-v] [-s] [-r] [-g] [-c] [-Ipath] [-Dname[=value]] [-o exefile] [-k exefile version] file ...
 //
 // Description:
 //   c is the c compiler.  It takes a single source file and creates an executable
 //   file or else executes the compiled code immediately.  The compiler does not
 //   reach full standards compliance, so some programs need minor adjustment.
-//   There is no preprocessor, although the #include keyword is allowed
-//   supporting a single level of file inclusion.
+//   The preprocessor is part of the scanner: #include nests, #define takes object and
+//   function like macros with # and ##, and #if, #ifdef, #ifndef, #elif, #else and #endif
+//   select lines.  An include file wrapped whole in #ifndef guard is not read again while
+//   its guard stays defined.
+//
+//   Each function is compiled straight to code and then tidied by a peephole pass that
+//   threads branch chains, drops unreachable code and redundant jumps, merges a few
+//   common instruction pairs and skips reloading locals a register already holds.
+//   A call to a function already compiled to a few instructions, or to a few dozen if it was
+//   declared inline, is replaced by a copy of its code.  A for loop stepping an int by a
+//   constant walks the arrays it indexes with it by pointer, and a bound of its test that the
+//   body can't change is loaded once before the loop.
 //
 //   The following options are supported:
 //
 //   -v  Verbose output.  Useful for finding undeclared function calls.
 //   -s  Print source and generated code.
+//   -r  Keep the busiest local of each leaf function in register c instead of the stack.
+//   -g  With -o, also write a symbol map exefile.map for prof and other tools.  Each line
+//       is a text offset (from the end of the header) in hex followed by F and a function
+//       name, or by L, a line number and a file name where the code for that line starts.
+//   -c  Write an object file for ld instead, named by -o or else after the source file
+//       with .o for its suffix.  Functions declared but not defined are left for ld to
+//       find in another object, functions declared static stay private to this one.
+//       Compile with -DNOLIBC to leave the libc functions to /lib/libc.o, see ld.
 //   -I  Path to include files (otherwise source directory or /lib/.)
+//   -D  Define name as a macro, to value or else to 1.
 //   -o  Create executable file and terminate normally.  If -o and -s are omitted,
 //       the compiled code is executed immediately (if there were no compile
 //       errors) with the command line arguments passed after the source file
@@ -24,6 +43,9 @@
 //           c echo.c hello world
 //       is also equivalent to,
 //           c c.c c.c c.c echo.c hello world
+//   -k  Also write the executable to exefile, with version in its header flags, before
+//       running it.  exec uses this to cache what it compiles for a command found only
+//       as source.
 //
 // Written by Robert Swierczek
 
@@ -33,10 +55,20 @@
 enum {
   SEG_SZ    = 8*1024*1024, // max size of text+data+bss seg
   EXPR_SZ   =      4*1024, // size of expression stack
-  VAR_SZ    =     64*1024, // size of symbol table
+  VAR_SZ    =    128*1024, // size of symbol table
   PSTACK_SZ =     64*1024, // size of patch stacks
   LSTACK_SZ =      4*1024, // size of locals stack
   HASH_SZ   =      8*1024, // number of hash table entries
+  SMAP_SZ   =    256*1024, // size of symbol map
+  PEEP_SZ   =     64*1024, // max instructions in a function for the peephole pass
+  INL_SZ    =          16, // max instructions in a function copied into its callers
+  INLX_SZ   =          64, // or in one declared inline
+  LOOP_SZ   =          32, // identifiers a scan ahead of a loop keeps track of
+  LQ_SZ     =          16, // arrays walked by pointer in the loops being compiled
+  IN_SZ     =          16, // nested include files, plus the macro expansion being read
+  MAC_SZ    =     64*1024, // macro expansion space
+  PAR_SZ    =          32, // macro parameters
+  GUARD_SZ  =         256, // include files known to be guarded
   BSS_TAG   =  0x10000000, // tag for patching global offsets
 };
 
@@ -45,10 +77,13 @@ typedef struct ident_s {
   uint type;
   int val;
   int local;
+  int inl;    // instructions of a function to copy in place of calls to it
   uint tk;
   char *name;
   int hash;
   struct ident_s *next;
+  int *mac;   // macro: {parameters + 1 or 0 if object like, busy, body...}
+  int priv;   // a function declared static, kept out of an object's symbols
 } ident_t;
 
 typedef struct {
@@ -79,6 +114,15 @@ typedef struct {
   int size;
 } array_t;
 
+typedef struct {
+  char *pos;      // where to go on reading
+  char *file;     // the file an include returns to, 0 for a macro expansion
+  int line;
+  char *mtop;     // macro space to give back
+  ident_t *guard; // the included file starts #ifndef guard
+  int gif, gok;   //   at this #if depth, and nothing follows its #endif
+} in_t;
+
 int tk,       // current token
     ts, ip,   // text segment, current pointer
     gs, data, // data segment, current offset
@@ -89,11 +133,22 @@ int tk,       // current token
     errs,     // number of errors
     verbose,  // print additional verbiage
     debug,    // print source and object code
+    symmap,   // write a symbol map
+    creg,     // keep a local of each leaf function in c
+    fargs,    // parameters of the function being compiled
+    ftail,    // no address in its frame taken and no label yet, so the frame can go before a tail call
+    tcall,    // the call rv() is about to compile is a tail call
+    *smap,    // symbol map: {text offset, 0, function ident} or {text offset, line, file}
+    *psmap,   // symbol map pointer
     ffun,     // unresolved forward function counter
     va, vp,   // variable pool, current pointer
     *e,       // expression tree pointer
+    object,   // write an object file
     *pdata,   // data segment patchup pointer
-    *pbss;    // bss segment patchup pointer
+    *pbss,    // bss segment patchup pointer
+    *patchdata, *patchbss, // patchup stacks
+    *fix,     // text of the current function the peephole pass must fix: {ip, forward function ident}
+    *pfix;    // or {JMPI ip, -jump table entries}
 
 ident_t *id;  // current parsed identifier
 double fval;  // current token double value
@@ -107,6 +162,21 @@ char *file,   // input file name
      *pos;    // input file position
 
 loc_t *ploc;  // local variable stack pointer
+ident_t *ht[HASH_SZ]; // identifier hash table
+
+// preprocessor
+in_t ins[IN_SZ], *pin; // input nesting
+char *mbuf, *mtop;     // macro space
+int nif, ppdef;        // #if depth, reading an #if expression
+ident_t *pdefined, *gid[GUARD_SZ]; // defined, guards of the files in gfile
+char *gfile[GUARD_SZ]; // include files read once that need not be read again while their guard is defined
+int ngd;
+
+// loop optimizer: what a scan of the source ahead of the parser says a loop body can disturb
+ident_t *lst[LOOP_SZ], *lad[LOOP_SZ], *fad[LOOP_SZ], *lbase[4]; // stored or addressed, addressed, addressed in the function, indexed by liv
+int lstn, ladn, fadn, lbn, lbc[4], lcall, lmem, lgoto, lcase, liv, fscan; // lbc: times each array is indexed
+int lq[LQ_SZ*6], lqn; // arrays walked by pointer: {class, val, element size, index local, pointer local, step}
+char *fbody;          // source of the function being compiled
 
 char ops[] =
   "HALT,ENT ,LEV ,JMP ,JMPI,JSR ,JSRA,LEA ,LEAG,CYC ,MCPY,MCMP,MCHR,MSET," // system
@@ -128,7 +198,7 @@ char ops[] =
   "PSHG,POPG,NET1,NET2,NET3,NET4,NET5,NET6,NET7,NET8,NET9,"
   "POW ,ATN2,FABS,ATAN,LOG ,LOGT,EXP ,FLOR,CEIL,HYPO,SIN ,COS ,TAN ,ASIN," // math
   "ACOS,SINH,COSH,TANH,SQRT,FMOD,"
-  "IDLE,";
+  "IDLE,LAC ,LBC ,";
 
 // types and type masks. specific bit patterns and orderings needed by expr()
 enum {
@@ -149,7 +219,7 @@ enum {
   Num = 128, // low ordering of Num and Auto needed by nodc()
 
   // keyword grouping needed by main()  XXX missing extern and register
-  Asm, Auto, Break, Case, Char, Continue, Default, Do, Double, Else, Enum, Float, For, Goto, If, Int, Long, Return, Short,
+  Asm, Auto, Break, Case, Char, Continue, Default, Do, Double, Else, Enum, Float, For, Goto, If, Inline, Int, Long, Return, Short,
   Sizeof, Static, Struct, Switch, Typedef, Union, Unsigned, Void, While, Va_list, Va_start, Va_arg,
 
   Id, Numf, Ptr, Not, Notf, Nzf, Lea, Leag, Fun, FFun, Fcall, Label, FLabel,
@@ -177,7 +247,13 @@ enum {
 void expr(int lev);
 void member(int stype, struct_t *s);
 void rv(int *a);
+int args(int *b);
+int *lidx(int *b, int k);
+void tailcall(int *a, int t);
 void stmt();
+void peep(int s);
+int inlsz(int s, int max);
+void inlcall(int s, int n);
 void node(int n, int *a, int *b);
 void cast(uint t);
 int testnot(int *a, int t);
@@ -241,6 +317,16 @@ void patch(int t, int a)
   }
 }
 
+// note where the code for the current line starts, replacing a line that produced none
+void mapline()
+{
+  static char *lfile;
+  if (psmap > smap && psmap[-3] == ip - ts && psmap[-2]) psmap -= 3;
+  if (psmap >= smap + SMAP_SZ/4 - 3) return;
+  if (!lfile || strcmp(lfile, file)) strcpy(lfile = new(strlen(file) + 1), file);
+  *psmap++ = ip - ts; *psmap++ = line; *psmap++ = (int)lfile;
+}
+
 // parser
 void dline()
 {
@@ -249,13 +335,389 @@ void dline()
   printf("%s  %d: %.*s\n", file, line, p - pos, pos);
 }
 
+// preprocessor: directives are carried out by next() as it meets them.  A macro hangs off its
+// identifier with each parameter in its body replaced by PP_ARG, PP_RAW (next to ##) or PP_STR
+// (after #) and 'a' + its number.  A use is expanded all the way into macro space, arguments
+// first, and next() reads the tokens from there without expanding them again.
+enum { PP_ARG = 1, PP_RAW, PP_STR };
+
+void next();
+int idch(int c);
+ident_t *look(char *p, int b);
+int imm();
+
+ident_t *ident(char *p, int b) // the identifier of b characters at p, made if new
+{
+  int h, i; ident_t *v;
+  if ((v = look(p, b))) return v;
+  for (h = *p, i = 1; i < b; i++) h = h * 147 + p[i];
+  v = (ident_t *) vp; vp += sizeof(ident_t);
+  v->name = p;
+  v->hash = h ^ b;
+  v->next = ht[h & (HASH_SZ - 1)];
+  v->tk = Id;
+  return ht[h & (HASH_SZ - 1)] = v;
+}
+
+char *ppws(char *p) // past blanks, comments and spliced lines within a line
+{
+  for (;;) {
+    switch (*p) {
+    case ' ': case '\t': case '\r': case '\f': case '\v': p++; continue;
+    case '\\':
+      if (p[1] == '\n') { p += 2; line++; continue; }
+      if (p[1] == '\r' && p[2] == '\n') { p += 3; line++; continue; }
+      return p;
+    case '/':
+      if (p[1] == '/') { while (*p && *p != '\n') p++; return p; }
+      if (p[1] == '*') {
+        for (p += 2; *p && (*p != '*' || p[1] != '/'); p++) if (*p == '\n') line++;
+        if (*p) p += 2;
+        continue;
+      }
+    default: return p;
+    }
+  }
+}
+
+char *ppeol(char *p) // to the newline ending a line
+{
+  int c;
+  for (;;) {
+    switch (c = *(p = ppws(p))) {
+    case 0: case '\n': return p;
+    case '"': case '\'':
+      for (p++; *p && *p != c && *p != '\n'; p++) if (*p == '\\' && p[1] && p[1] != '\n') p++;
+      if (*p == c) p++;
+      continue;
+    default: p++;
+    }
+  }
+}
+
+char *ppblank(char *p) // past blank lines, without counting them
+{
+  int l = line;
+  while (*(p = ppws(p)) == '\n') p++;
+  line = l;
+  return p;
+}
+
+char *mblank(char *p, char *e, int count) // past blanks, newlines and comments up to e (0 for none)
+{
+  for (; !e || p < e; p++) {
+    if (*p == '\n') { if (count) line++; }
+    else if (*p == '/' && p[1] == '*') {
+      for (p += 2; *p && (*p != '*' || p[1] != '/'); p++) if (*p == '\n' && count) line++;
+      if (!*p) return p;
+      p++;
+    }
+    else if (*p == '/' && p[1] == '/') { while (p[1] && p[1] != '\n') p++; }
+    else if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\f' && *p != '\v') break;
+  }
+  return p;
+}
+
+void mroom(char *d, int n)
+{
+  if (d + n > mbuf + MAC_SZ) { err("macro expansion too big"); exit(-1); }
+}
+
+ident_t *ppid() // the macro name at pos
+{
+  char *p = pos;
+  if (!idch(*pos) || (*pos >= '0' && *pos <= '9')) { err("bad macro name"); return 0; }
+  while (idch(*pos)) pos++;
+  return ident(p, pos - p);
+}
+
+void ppdefine()
+{
+  char *p, *d, *par[PAR_SZ]; int np, i, c, paste, plen[PAR_SZ], *m; ident_t *v;
+
+  if (!(v = ppid())) return;
+  np = 0;
+  if (*pos == '(') { // parameters
+    for (pos = ppws(pos + 1); *pos != ')'; pos = ppws(pos)) {
+      if (np == PAR_SZ || !idch(*pos)) { err("bad macro parameters"); return; }
+      for (par[np] = pos; idch(*pos); pos++) ;
+      plen[np] = pos - par[np]; np++;
+      if (*(pos = ppws(pos)) == ',') pos++;
+    }
+    pos++; np++;
+  }
+
+  // the body, to the end of the line, is put together in macro space
+  for (d = mtop, paste = 0, pos = ppws(pos); *pos && *pos != '\n'; ) {
+    mroom(d, 2);
+    if ((p = ppws(pos)) != pos) { pos = p; if (!paste) *d++ = ' '; continue; }
+    if ((c = *pos) == '#' && pos[1] == '#') {
+      while (d > mtop && d[-1] == ' ') d--;
+      if (d - mtop >= 2 && d[-2] == PP_ARG) d[-2] = PP_RAW;
+      pos = ppws(pos + 2); paste = 1;
+      continue;
+    }
+    if (c == '#' && np) {
+      for (p = pos = ppws(pos + 1); idch(*pos); pos++) ;
+      for (i = 0; i < np - 1 && (plen[i] != pos - p || memcmp(par[i], p, pos - p)); i++) ;
+      if (i == np - 1) { err("# needs a macro parameter"); return; }
+      *d++ = PP_STR; *d++ = 'a' + i; paste = 0;
+      continue;
+    }
+    if (c == '"' || c == '\'') {
+      for (*d++ = *pos++; *pos && *pos != c && *pos != '\n'; *d++ = *pos++) {
+        mroom(d, 2);
+        if (*pos == '\\' && pos[1]) *d++ = *pos++;
+      }
+      if (*pos == c) *d++ = *pos++;
+      paste = 0;
+      continue;
+    }
+    if (idch(c)) {
+      for (p = pos; idch(*pos) || (*pos == '.' && c >= '0' && c <= '9'); pos++) ;
+      for (i = 0; i < np - 1 && (plen[i] != pos - p || memcmp(par[i], p, pos - p)); i++) ;
+      if (i < np - 1 && !(c >= '0' && c <= '9')) { *d++ = paste ? PP_RAW : PP_ARG; *d++ = 'a' + i; }
+      else { mroom(d, pos - p); memcpy(d, p, pos - p); d += pos - p; }
+      paste = 0;
+      continue;
+    }
+    *d++ = *pos++; paste = 0;
+  }
+  while (d > mtop && d[-1] == ' ') d--;
+  *d++ = 0;
+  m = new(8 + (d - mtop));
+  m[0] = np; m[1] = 0;
+  memcpy(m + 2, mtop, d - mtop);
+  v->mac = m;
+}
+
+void ppcmd(char *s) // -Dname or -Dname=value
+{
+  char *p; int *m;
+  for (p = s; idch(*p); p++) ;
+  if (p == s || (*s >= '0' && *s <= '9')) { dprintf(2,"%s : bad macro name %s\n", cmd, s); exit(-1); }
+  s = (char *) ident(s, p - s);
+  if (*p == '=') p++; else p = "1";
+  m = new(8 + strlen(p) + 1);
+  m[0] = m[1] = 0;
+  strcpy((char *)(m + 2), p);
+  ((ident_t *) s)->mac = m;
+}
+
+char *mexp(ident_t *v, char **ps, char *e, char *d);
+
+char *mscan(char *s, char *e, char *d) // copy s up to e to d expanding the macros in it
+{
+  char *p; int c; ident_t *v;
+  while (s < e) {
+    mroom(d, 2);
+    c = *s;
+    if (idch(c) && !(c >= '0' && c <= '9')) {
+      for (p = s; s < e && idch(*s); s++) ;
+      if ((v = look(p, s - p)) && v->mac && !v->mac[1] && (!v->mac[0] || *mblank(s, e, 0) == '(')) {
+        *d++ = ' '; d = mexp(v, &s, e, d); mroom(d, 1); *d++ = ' ';
+      } else {
+        mroom(d, s - p); memcpy(d, p, s - p); d += s - p;
+      }
+    }
+    else if (c >= '0' && c <= '9') {
+      do *d++ = *s++; while (s < e && (idch(*s) || *s == '.'));
+    }
+    else if (c == '"' || c == '\'') {
+      for (*d++ = *s++; s < e && *s != c; *d++ = *s++) {
+        mroom(d, 2);
+        if (*s == '\\' && s + 1 < e) *d++ = *s++;
+      }
+      if (s < e) *d++ = *s++;
+    }
+    else if (c == '/' && (s[1] == '/' || s[1] == '*')) {
+      if (s[1] == '/') while (s < e && *s != '\n') s++;
+      else { for (s += 2; s < e && (*s != '*' || s[1] != '/'); s++) ; s += 2; }
+      *d++ = ' ';
+    }
+    else { *d++ = (c == '\n') ? ' ' : c; s++; }
+  }
+  return d;
+}
+
+// expand a use of macro v, the name of which ends at *ps, into d.  its arguments are read up
+// to e, or for source text (e = 0) as far as they go, counting lines
+char *mexp(ident_t *v, char **ps, char *e, char *d)
+{
+  int *m = v->mac, n, k, i, c; char *p, *s, *b, *a[PAR_SZ], *ae[PAR_SZ];
+
+  if (!m[0]) {
+    s = (char *)(m + 2);
+    m[1] = 1; d = mscan(s, s + strlen(s), d); m[1] = 0;
+    return d;
+  }
+
+  // collect the arguments
+  p = mblank(*ps, e, !e) + 1;
+  for (n = 0; ; ) {
+    if (n == PAR_SZ) { err("too many macro arguments"); break; }
+    a[n] = p = mblank(p, e, !e);
+    for (k = 0; (!e || p < e) && *p && (k || (*p != ',' && *p != ')')); p++) {
+      if (*p == '(') k++;
+      else if (*p == ')') k--;
+      else if (*p == '\n') { if (!e) line++; }
+      else if ((c = *p) == '"' || c == '\'') {
+        for (p++; (!e || p < e) && *p && *p != c; p++) if (*p == '\\' && p[1]) p++;
+        if (!*p) break;
+      }
+    }
+    for (s = p; s > a[n] && (s[-1] == ' ' || s[-1] == '\t' || s[-1] == '\n' || s[-1] == '\r'); s--) ;
+    ae[n++] = s;
+    if ((e && p >= e) || !*p) { err("unterminated macro call"); break; }
+    if (*p++ == ')') break;
+  }
+  *ps = p;
+  if (n == 1 && m[0] == 1 && ae[0] == a[0]) n = 0;
+  if (n != m[0] - 1) err("wrong number of macro arguments");
+
+  // substitute them, then rescan with v busy
+  for (b = d, s = (char *)(m + 2); *s; s++) {
+    mroom(d, 2);
+    if (*s != PP_ARG && *s != PP_RAW && *s != PP_STR) { *d++ = *s; continue; }
+    if ((i = *++s - 'a') >= n) continue;
+    if (s[-1] == PP_ARG) { *d++ = ' '; d = mscan(a[i], ae[i], d); mroom(d, 1); *d++ = ' '; }
+    else if (s[-1] == PP_RAW) { mroom(d, ae[i] - a[i]); memcpy(d, a[i], ae[i] - a[i]); d += ae[i] - a[i]; }
+    else {
+      *d++ = '"';
+      for (p = a[i], c = 0; p < ae[i]; p++) { // white space outside literals becomes one blank
+        mroom(d, 4);
+        if (!c && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) { if (d[-1] != ' ') *d++ = ' '; continue; }
+        if (*p == '"' || *p == '\\') *d++ = '\\';
+        *d++ = *p;
+        if (c && *p == '\\' && p + 1 < ae[i]) { if (*++p == '"' || *p == '\\') *d++ = '\\'; *d++ = *p; }
+        else if (*p == '"' || *p == '\'') c = (c == *p) ? 0 : c ? c : *p;
+      }
+      *d++ = '"';
+    }
+  }
+  m[1] = 1; p = mscan(b, d, d); m[1] = 0;
+  for (s = d; s < p; ) *b++ = *s++;
+  return b;
+}
+
+int ppif() // the #if expression on the rest of the line
+{
+  int c; uint t = ty;
+  ppdef = 1;
+  next();
+  c = imm();
+  if (tk) err("bad #if expression");
+  ppdef = 0;
+  ty = t;
+  return c;
+}
+
+void ppelse() // an #else or #elif in the group of an include guard: the file isn't guarded after all
+{
+  if (pin > ins && pin[-1].guard && pin[-1].gif == nif - 1) pin[-1].guard = 0;
+}
+
+void ppskip(int done) // skip lines to the #endif, or unless a group was taken to an #else or an #elif that holds
+{
+  int d, n; char *p;
+  for (d = 0; ; ) {
+    if (!*(pos = ppeol(pos))) { err("missing #endif"); nif = 0; return; }
+    pos++; line++;
+    if (*(pos = ppws(pos)) != '#') continue;
+    for (p = pos = ppws(pos + 1); idch(*pos); pos++) ;
+    n = pos - p;
+    pos = ppws(pos);
+    if ((n == 2 && !memcmp(p, "if", 2)) || (n == 5 && !memcmp(p, "ifdef", 5)) || (n == 6 && !memcmp(p, "ifndef", 6))) d++;
+    else if (n == 5 && !memcmp(p, "endif", 5)) { if (!d--) { nif--; return; } }
+    else if (d) continue;
+    else if (n == 4 && (!memcmp(p, "else", 4) || !memcmp(p, "elif", 4))) {
+      ppelse();
+      if (!done && (p[2] == 's' || ppif())) return;
+    }
+  }
+}
+
+void ppinclude()
+{
+  char *p; int b, i; struct stat st;
+  static char iname[512]; // XXX 512
+
+  if (*pos != '"' && *pos != '<') { err("bad include file name"); exit(-1); } // include errors bail out otherwise it gets messy
+  p = pos++;
+  if (*pos == '/')
+    b = 0;
+  else if (incl) {
+    memcpy(iname, incl, b = strlen(incl)); iname[b++] = '/';
+  } else {
+    for (b = strlen(file); b; b--) if (file[b-1] == '/') { memcpy(iname, file, b); break; }
+  }
+  while (*pos && *pos != '>' && *pos != '"' && b < sizeof(iname)-1) iname[b++] = *pos++;
+  iname[b] = 0;
+  if (stat(iname, &st)) {
+    if (*p == '"' || p[1] == '/')
+      { dprintf(2,"%s : [%s:%d] error: can't stat file %s\n", cmd, file, line, iname); exit(-1); }
+    memcpy(iname, "/lib/", b = 5);
+    pos = p + 1;
+    while (*pos && *pos != '>' && *pos != '"' && b < sizeof(iname)-1) iname[b++] = *pos++;
+    iname[b] = 0;
+    if (stat(iname, &st)) { dprintf(2,"%s : [%s:%d] error: can't stat file %s\n", cmd, file, line, iname); exit(-1); }
+  }
+  pos = ppeol(pos + 1);
+  for (i = 0; i < ngd; i++) if (gid[i]->mac && !strcmp(gfile[i], iname)) return; // guarded, and read already
+  if (pin == ins + IN_SZ - 1) { err("include files nested too deeply"); exit(-1); }
+  pin->pos = pos; pin->file = file; pin->line = line;
+  pin->guard = 0; pin->gok = 0;
+  file = strcpy(new(b + 1), iname);
+  pos = mapfile(iname, st.st_size);
+  line = 1;
+
+  // a file starting #ifndef guard might not need reading again
+  if (*(p = ppblank(pos)) == '#') {
+    b = line; p = ppws(p + 1);
+    if (!memcmp(p, "ifndef", 6) && (p = ppws(p + 6)) && idch(*p) && !(*p >= '0' && *p <= '9')) {
+      for (i = 0; idch(p[i]); i++) ;
+      pin->guard = ident(p, i); pin->gif = nif;
+    }
+    line = b;
+  }
+  pin++;
+  if (debug) dline(); if (symmap) mapline();
+}
+
+void pp() // a directive, pos just past its #
+{
+  char *p; int n, c; ident_t *v;
+
+  if (pin > ins && !pin[-1].file) { err("bad token"); return; }
+  for (p = pos = ppws(pos); idch(*pos); pos++) ;
+  n = pos - p;
+  pos = ppws(pos);
+  if (n == 7 && !memcmp(p, "include", 7)) { ppinclude(); return; }
+  if (n == 6 && !memcmp(p, "define", 6)) ppdefine();
+  else if (n == 5 && !memcmp(p, "undef", 5)) { if ((v = ppid())) v->mac = 0; }
+  else if ((n == 5 && !memcmp(p, "ifdef", 5)) || (n == 6 && !memcmp(p, "ifndef", 6))) {
+    nif++;
+    c = (v = ppid()) && v->mac;
+    if (n == 6) c = !c;
+    if (!c) { pos = ppeol(pos); ppskip(0); }
+  }
+  else if (n == 2 && !memcmp(p, "if", 2)) { nif++; if (!ppif()) { pos = ppeol(pos); ppskip(0); } }
+  else if (n == 4 && (!memcmp(p, "else", 4) || !memcmp(p, "elif", 4))) {
+    if (!nif) err("#else without #if"); else { ppelse(); pos = ppeol(pos); ppskip(1); }
+  }
+  else if (n == 5 && !memcmp(p, "endif", 5)) {
+    if (!nif) err("#endif without #if");
+    else if (--nif, pin > ins && pin[-1].guard && pin[-1].gif == nif) { // the guard's group ends, last thing in the file?
+      if (*ppblank(ppeol(pos))) pin[-1].guard = 0; else pin[-1].gok = 1;
+    }
+  }
+  else if (n == 5 && !memcmp(p, "error", 5)) err("#error");
+  pos = ppeol(pos);
+}
+
 void next()
 {
   char *p; int b; ident_t **hm;
-  struct stat st;
-  static char iname[512], *ifile, *ipos; // XXX 512
-  static int iline;
-  static ident_t *ht[HASH_SZ];
 
   for (;;) {
     switch (tk = *pos++) {
@@ -263,42 +725,19 @@ void next()
       continue;
 
     case '\n':
-      line++; if (debug) dline();
+      if (ppdef) { pos--; tk = 0; return; }
+      line++; if (debug) dline(); if (symmap) mapline();
       continue;
 
     case '#':
-      if (!memcmp(pos,"include",7)) {
-        if (ifile) { err("can't nest include files"); exit(-1); } // include errors bail out otherwise it gets messy
-        pos += 7;
-        while (*pos == ' ' || *pos == '\t') pos++;
-        if (*pos != '"' && *pos != '<') { err("bad include file name"); exit(-1); }
-        ipos = pos++;
-        if (*pos == '/')
-          b = 0;
-        else if (incl) {
-          memcpy(iname, incl, b = strlen(incl)); iname[b++] = '/';
-        } else {
-          for (b = strlen(file); b; b--) if (file[b-1] == '/') { memcpy(iname, file, b); break; }
-        }
-        while (*pos && *pos != '>' && *pos != '"' && b < sizeof(iname)-1) iname[b++] = *pos++;
-        iname[b] = 0;
-        if (stat(iname, &st)) {
-          if (*ipos == '"' || ipos[1] == '/')
-            { dprintf(2,"%s : [%s:%d] error: can't stat file %s\n", cmd, file, line, iname); exit(-1); }
-          memcpy(iname, "/lib/", b = 5);
-          pos = ipos + 1;
-          while (*pos && *pos != '>' && *pos != '"' && b < sizeof(iname)-1) iname[b++] = *pos++;
-          iname[b] = 0;
-          if (stat(iname, &st)) { dprintf(2,"%s : [%s:%d] error: can't stat file %s\n", cmd, file, line, iname); exit(-1); }
-        }
-        while (*pos && *pos != '\n') pos++;
-        ipos = pos; pos = mapfile(iname, st.st_size);
-        ifile = file; file = iname;
-        iline = line; line = 1;
-        if (debug) dline();
-        continue;
-      }
-      while (*pos && *pos != '\n') pos++;
+      if (ppdef) { pos--; tk = 0; return; }
+      pp();
+      continue;
+
+    case '\\':
+      if (*pos == '\n') { pos++; line++; continue; } // spliced line
+      if (*pos == '\r' && pos[1] == '\n') { pos += 2; line++; continue; }
+      err("bad token");
       continue;
 
     case 'a' ... 'z': case 'A' ... 'Z': case '_': case '$':
@@ -314,15 +753,36 @@ void next()
       id = *(hm = &ht[tk & (HASH_SZ - 1)]);
       tk ^= (b = pos - p);
       while (id) {
-        if (tk == id->hash && (b < 5 || !memcmp(id->name, p, b))) { tk = id->tk; return; } // b < 5 dependant on hash func and size
+        if (tk == id->hash && (b < 5 || !memcmp(id->name, p, b))) break; // b < 5 dependant on hash func and size
         id = id->next;
       }
-      id = (ident_t *) vp; vp += sizeof(ident_t);
-      id->name = p;
-      id->hash = tk;
-      id->next = *hm;
-      tk = id->tk = Id;
-      *hm = id;
+      if (!id) {
+        id = (ident_t *) vp; vp += sizeof(ident_t);
+        if (pin > ins && !pin[-1].file) { memcpy(id->name = new(b + 1), p, b); id->name[b] = 0; } // macro space is reused
+        else id->name = p;
+        id->hash = tk;
+        id->next = *hm;
+        id->tk = Id;
+        *hm = id;
+      }
+      if (ppdef && id == pdefined) { // defined name or defined(name)
+        if ((b = (*(p = ppws(pos)) == '('))) p = ppws(p + 1);
+        for (pos = p; idch(*pos); pos++) ;
+        ival = (id = look(p, pos - p)) && id->mac;
+        if (b) { if (*(pos = ppws(pos)) == ')') pos++; else err("bad defined"); }
+        tk = Num; ty = INT;
+        return;
+      }
+      if (id->mac && !id->mac[1] && (pin == ins || pin[-1].file) && (!id->mac[0] || *mblank(pos, 0, 0) == '(')) {
+        p = mtop;
+        mtop = mexp(id, &pos, 0, p);
+        *mtop++ = 0;
+        pin->pos = pos; pin->file = 0; pin->mtop = p; pin++;
+        pos = p;
+        continue;
+      }
+      if (ppdef) { tk = Num; ival = 0; ty = INT; return; } // an identifier in #if that isn't a macro
+      tk = id->tk;
       return;
 
     case '0' ... '9':
@@ -367,7 +827,7 @@ frac:     b = 10;
       } else if (*pos == '*') { // comment
         while (*++pos) {
           if (*pos == '*' && pos[1] == '/') { pos += 2; break; }
-          else if (*pos == '\n') { line++; if (debug) { pos++; dline(); pos--; } }
+          else if (*pos == '\n') { line++; if (debug) { pos++; dline(); pos--; } if (symmap) mapline(); }
         }
         continue;
       }
@@ -390,7 +850,7 @@ frac:     b = 10;
           case 'v': b = '\v'; break; // vertical tab
           case 'e': b = '\e'; break; // escape
           case '\r': while (*pos == '\r' || *pos == '\n') pos++; // XXX not sure if this is right
-          case '\n': line++; if (debug) dline(); continue;
+          case '\n': line++; if (debug) dline(); if (symmap) mapline(); continue;
           case 'x':
 //            b = (*pos - '0') * 16 + pos[1] - '0'; pos += 2; // XXX this is broke!!! 0xFF needs to become -1 also
             switch (*pos) {
@@ -461,10 +921,17 @@ frac:     b = 10;
     case ')':
     case ']': return;
     case 0:
-      if (!ifile) { pos--; return; }
-      file = ifile; ifile = 0;
-      pos = ipos;
-      line = iline;
+      if (pin > ins && !pin[-1].file) { pin--; pos = pin->pos; mtop = pin->mtop; continue; } // end of a macro expansion
+      if (ppdef || pin == ins) {
+        if (!ppdef && nif) { err("missing #endif"); nif = 0; }
+        pos--; return;
+      }
+      pin--;
+      if (pin->gok && ngd < GUARD_SZ) { gfile[ngd] = file; gid[ngd++] = pin->guard; }
+      file = pin->file;
+      pos = pin->pos;
+      line = pin->line;
+      if (symmap) mapline();
       continue;
 
     default: err("bad token"); continue;
@@ -710,11 +1177,13 @@ uint *type(uint *t, ident_t **v, uint bt)
 
 void decl(bc)
 {
-  int sc, size, align, hglo, *b, *c = 0; uint bt, t; ident_t *v; loc_t *sp;
+  int sc, pv, size, align, hglo, inl, *b, *c = 0; uint bt, t; ident_t *v, *fv; loc_t *sp;
 
   for (;;) {
+    for (inl = 0; tk == Inline; next()) inl = 1;
+    pv = (tk == Static && bc == Static);
     if (tk == Static || tk == Typedef || (tk == Auto && bc == Auto))
-      { sc = tk; next(); if (!(bt = basetype())) bt = INT; } // XXX typedef inside function?  probably bad!
+      { sc = tk; next(); for (; tk == Inline; next()) inl = 1; if (!(bt = basetype())) bt = INT; } // XXX typedef inside function?  probably bad!
     else { if (!(bt = basetype())) { if (bc == Auto) break; bt = INT; } sc = bc; }
     if (!tk) break;
     if (tk == ';') { next(); continue; } // XXX is this valid?
@@ -733,9 +1202,17 @@ void decl(bc)
             bt != *(uint *)(va+(t>>TSHIFT)+4))) err("conflicting forward function declaration");
         }
         else if (v->class) err("duplicate function definition");
+        fv = ((loc_t *)v >= sp && (loc_t *)v < ploc) ? ((loc_t *)v)->id : v; // v is a parameter's slot if it has the function's name
         v->class = Fun;
         v->type = t;
-        v->val = ip;
+        v->val = hglo = ip;
+        fv->priv |= pv;
+        fv->inl = 0;
+        for (fargs = 0, bt = *(uint *)(va+(t>>TSHIFT)+4); bt; bt >>= 2) fargs++;
+        ftail = 1;
+        fbody = pos; fscan = 0;
+        pfix = fix;
+        if (symmap && psmap < smap + SMAP_SZ/4 - 3) { *psmap++ = ip - ts; *psmap++ = 0; *psmap++ = (int)fv; }
         loc = 0;
         next();
         b = e;
@@ -746,6 +1223,8 @@ void decl(bc)
         while (tk != '}') stmt(); // XXX null check
         next();
         emi(LEV,-loc);
+        peep(hglo);
+        fv->inl = inlsz(hglo, inl ? INLX_SZ : INL_SZ);
         while (ploc != sp) {
           ploc--;
           v = ploc->id;
@@ -758,9 +1237,11 @@ void decl(bc)
         break;
       } else if ((t & TMASK) == FUN) {
 //        if (bc != Static || sc != Static) err("bad nested function declaration");
-        if (v->class) err("duplicate function declaration");
+        if (v->class == FFun) ffun--; // libc.h may repeat a prototype or follow an implicit call
+        else if (v->class) err("duplicate function declaration");
         v->class = FFun;
         v->type = t;
+        v->priv = pv;
         ffun++;
         while (ploc != sp) {
           ploc--;
@@ -898,18 +1379,32 @@ void nodc(int n, int *a, int *b) // commutative
   if (*a < *b) { e[1] = (int)b; e[2] = (int)a; } else { e[1] = (int)a; e[2] = (int)b; } // put simpler expression in rhs
 }
 
+int lg(uint n) // log2 of a power of two, else -1
+{
+  int k;
+  if (!n || (n & (n - 1))) return -1;
+  for (k = 0; n > 1; k++) n >>= 1;
+  return k;
+}
+
 void mul(int *b) // XXX does this handle unsigned correctly?
 {
+  int k;
   if (*b == Num) {
     if (*e == Num) { e[2] *= b[2]; return; }
     if (b[2] == 1) return;
+    if ((k = lg(b[2])) > 0) { b[2] = k; node(Shl,e,b); return; }
+  }
+  if (*e == Num) {
+    if (e[2] == 1) { e = b; return; } // XXX reliable???
+    if ((k = lg(e[2])) > 0) { e[2] = k; node(Shl,b,e); return; }
   }
-  if (*e == Num && e[2] == 1) { e = b; return; } // XXX reliable???
   nodc(Mul,e,b);
 }
 
-void add(uint *b)  // XXX make sure to optimize (a + 9 + 2) -> (a + 11)    and    (a + 9 - 2) -> (a + 7)
+void add(uint *b)
 {
+  if (*e == Num && *b == Add && *(int *)b[2] == Num) { e[2] += ((int *)b[2])[2]; b = (uint *)b[1]; } // (a + 9 + 2) -> (a + 11), the Num may be shared by x++
   if (*b == Num) {
     if (*e == Num || *e == Lea || *e == Leag) { e[2] += b[2]; return; } // XXX  <<>> check
     if (!b[2]) return;
@@ -992,6 +1487,7 @@ void cast(uint t)
       { if (*e == Num) { *e = Numf; *(double *)(e+2) = (uint)e[2]; } else { *(e-=2) = Cud; e[1] = (int)(e+2); } }
   } else if (t < UINT) {
     if (ty == DOUBLE || ty == FLOAT) { if (*e == Numf) { *e = Num; e[2] = (int)*(double *)(e+2); } else *(e-=2) = Cdi;}
+    if (t == ty || (t == SHORT && (ty == CHAR || ty == UCHAR)) || (t == USHORT && ty == UCHAR)) return; // already in range
     switch (t) {
     case CHAR:   if (*e == Num) e[2] = (char)   e[2]; else *(e-=2) = Cic; break;
     case UCHAR:  if (*e == Num) e[2] = (uchar)  e[2]; else *(e-=2) = Cuc; break;
@@ -1005,7 +1501,7 @@ void cast(uint t)
 
 void expr(int lev)
 {
-  int *b, *d, *dd; uint t, tt; member_t *m;
+  int *b, *d, *dd, k; uint t, tt; member_t *m;
 
   switch (tk) {
   case Num:
@@ -1029,6 +1525,7 @@ void expr(int lev)
   case Id:
     if (id->class) {
       node(id->class, (int *)(ty = id->type), (id->class == FFun) ? (int *)id : (int *)id->val);
+      if (id->class == Fun) e[3] = id->inl;
       next();
       break;
     }
@@ -1094,7 +1591,8 @@ void expr(int lev)
     case Ltf: *e = Gef; break;
     case Gef: *e = Ltf; break;
     default:
-      if (ty < FLOAT || (ty & PMASK)) *(e-=2) = Not;
+      if (*e == Num) e[2] = !e[2];
+      else if (ty < FLOAT || (ty & PMASK)) *(e-=2) = Not;
       else if (ty >= STRUCT) err("bad operand to !");
       else *(e-=2) = Notf;
       ty = INT;
@@ -1171,19 +1669,22 @@ void expr(int lev)
       next(); expr(Assign);
       if ((tt=t|ty) >= STRUCT) err("bad operands to *=");
       else if (tt & FLOAT) { e = flot(e,ty); ty = t; assign(Mulaf,b); }
-      else { ty = t; assign(Mula,b); }
+      else { ty = t; if (*e == Num && (k = lg(e[2])) > 0) { e[2] = k; assign(Shla,b); } else assign(Mula,b); }
       continue;
 
     case Diva:
       next(); expr(Assign);
       if ((tt=t|ty) >= STRUCT) err("bad operands to /=");
       else if (tt & FLOAT) { e = flot(e,ty); ty = t; assign(Divaf,b); }
+      else if ((tt & UINT) && *e == Num && (k = lg(e[2])) > 0) { ty = t; e[2] = k; assign(Srua,b); }
       else { ty = t; assign((tt & UINT) ? Dvua : Diva, b); }
       continue;
 
     case Moda:
       next(); expr(Assign);
-      if ((tt=t|ty) >= FLOAT) err("bad operands to %="); else { ty = t; assign((tt & UINT) ? Mdua : Moda, b); }
+      if ((tt=t|ty) >= FLOAT) err("bad operands to %=");
+      else if ((tt & UINT) && *e == Num && lg(e[2]) >= 0) { ty = t; e[2]--; assign(Anda,b); }
+      else { ty = t; assign((tt & UINT) ? Mdua : Moda, b); }
       continue;
 
     case Anda:
@@ -1221,21 +1722,23 @@ void expr(int lev)
         else if (tt & FLOAT) { dd = flot(dd,ty); d = flot(d,t); ty = DOUBLE; }
         else { ty = (tt & UINT) ? UINT : INT; }
       }
-      node(Cond,b,d); e[3] = (int)dd;
+      if (*b == Num) e = b[2] ? d : dd; else { node(Cond,b,d); e[3] = (int)dd; }
       continue;
 
     case Lor:
       if (ty == DOUBLE || ty == FLOAT) *(b = e-=2) = Nzf;
       next(); expr(Lan);
       if (ty == DOUBLE || ty == FLOAT) *(e-=2) = Nzf;
-      *(e-=2) = Lor; e[1] = (int)b; ty = INT;
+      if (*b == Num && *e == Num) e[2] = b[2] || e[2]; else { *(e-=2) = Lor; e[1] = (int)b; }
+      ty = INT;
       continue;
 
     case Lan:
       if (ty == DOUBLE || ty == FLOAT) *(b = e-=2) = Nzf;
       next(); expr(Or);
       if (ty == DOUBLE || ty == FLOAT) *(e-=2) = Nzf;
-      *(e-=2) = Lan; e[1] = (int)b; ty = INT;
+      if (*b == Num && *e == Num) e[2] = b[2] && e[2]; else { *(e-=2) = Lan; e[1] = (int)b; }
+      ty = INT;
       continue;
 
     case Or:
@@ -1362,7 +1865,7 @@ void expr(int lev)
         node(Sub,b,e);
         d = e;
         *(e-=4) = Num; e[2] = tt;
-        node(Div,d,e);
+        if (tt == 1) e = d; else if ((k = lg(tt)) > 0) { e[2] = k; node(Shr,d,e); } else node(Div,d,e); // exact, so a shift will do
         ty = INT;
       } else if ((t & PAMASK) && ty <= UINT) {
         if ((tt = tinc(t)) > 1) { *(e-=4) = Num; e[2] = tt; mul(e+4); }
@@ -1388,7 +1891,9 @@ void expr(int lev)
         d = flot(e,ty); b = flot(b,t);
         if (*b == Numf && *d == Numf) {
           *e = Numf; *(double *)(e+2) = *(double *)(b+2) * *(double *)(d+2);
-        } else nodc(Mulf,b,d);
+        } else if (*d == Numf && *(double *)(d+2) == 1.0) e = b;
+        else if (*b == Numf && *(double *)(b+2) == 1.0) e = d;
+        else nodc(Mulf,b,d);
         ty = DOUBLE;
       } else { mul(b); ty = (tt & UINT) ? UINT : INT; }
       continue;
@@ -1400,17 +1905,28 @@ void expr(int lev)
         d = flot(e,ty); b = flot(b,t);
         if (*b == Numf && *d == Numf && *(double *)(d+2)) {
           *e = Numf; *(double *)(e+2) = *(double *)(b+2) / *(double *)(d+2);
-        } else node(Divf,b,d);
+        } else if (*d == Numf && *(double *)(d+2) == 1.0) e = b;
+        else node(Divf,b,d);
         ty = DOUBLE;
       }
-      else if (tt & UINT) { if (*b == Num && *e == Num && e[2]) e[2] = b[2] / (uint)e[2]; else node(Dvu,b,e); ty = UINT; }
+      else if (tt & UINT) {
+        if (*b == Num && *e == Num && e[2]) e[2] = b[2] / (uint)e[2];
+        else if (*e == Num && (k = lg(e[2])) > 0) { e[2] = k; node(Sru,b,e); }
+        else node(Dvu,b,e);
+        ty = UINT;
+      }
       else { if (*b == Num && *e == Num && e[2]) e[2] = b[2] / e[2]; else node(Div,b,e); ty = INT; }
       continue;
 
     case Mod:
       next(); expr(Inc);
       if ((tt=t|ty) >= FLOAT) err("bad operands to %");
-      else if (tt & UINT) { if (*b == Num && *e == Num && e[2]) e[2] = b[2] % (uint)e[2]; else node(Mdu,b,e); ty = UINT; }
+      else if (tt & UINT) {
+        if (*b == Num && *e == Num && e[2]) e[2] = b[2] % (uint)e[2];
+        else if (*e == Num && lg(e[2]) >= 0) { e[2]--; nodc(And,b,e); }
+        else node(Mdu,b,e);
+        ty = UINT;
+      }
       else { if (*b == Num && *e == Num && e[2]) e[2] = b[2] % e[2]; else node(Mod,b,e); ty = INT; }
       continue;
 
@@ -1448,6 +1964,7 @@ found:
       next();  // addr(); b = e; t = ty; // XXX
       expr(Comma);
       skip(']');
+      if (lqn && lidx(b, tinc(t))) { ty = t; ind(); continue; } // walked by pointer
       d = e;
       *(e-=4) = Num; e[2] = tinc(t);
       mul(d);
@@ -1859,7 +2376,7 @@ void rv(int *a)
     em(LX+lmod(t));
     return;
 
-  case Lea:  eml(LEA,  a[2]); return;
+  case Lea:  eml(LEA,  a[2]); ftail = 0; return;
   case Leag: emg(LEAG, a[2]); return;
 
   case Auto:   eml(LL+lmod(a[1]), a[2]); return;
@@ -1869,20 +2386,17 @@ void rv(int *a)
 
   case FFun:
     n = (ident_t *)a[2];
+    *pfix++ = ip; *pfix++ = (int)n;
     n->val = emf(LEAG, n->val);
     return;
 
   case Fcall:
-    b = (int *)a[2];
+    c = tcall; tcall = 0;
+    t = args((int *)a[2]);
+    if (c && ftail) { tailcall(a, t); return; } // unless an argument took a frame address
     a = (int *)a[1];
-    for (t = 0; b; t += 8) {
-      if (b[1] == DOUBLE || b[1] == FLOAT) { rv(b+2); loc -= 8; em(PSHF); }
-      else if (b[2] == Num && b[4]<<8>>8 == b[4]) { loc -= 8; emi(PSHI,b[4]); }
-      else { rv(b+2); loc -= 8; em(PSHA); }
-      b = (int *)*b;
-    }
-    if (*a == FFun) { n = (ident_t *)a[2]; n->val = emf(JSR, n->val); }
-    else if (*a == Fun) emj(JSR, a[2]);
+    if (*a == FFun) { n = (ident_t *)a[2]; *pfix++ = ip; *pfix++ = (int)n; n->val = emf(JSR, n->val); }
+    else if (*a == Fun) { if (a[3]) inlcall(a[2], a[3]); else emj(JSR, a[2]); }
     else { rv(a); em(JSRA); } // function address
     if (t) { emi(ENT,t); loc += t; }
     return;
@@ -1892,11 +2406,643 @@ void rv(int *a)
   }
 }
 
+// push the arguments of a call, last first.  returns the bytes pushed
+int args(int *b)
+{
+  int t;
+  for (t = 0; b; t += 8) {
+    if (b[1] == DOUBLE || b[1] == FLOAT) { rv(b+2); loc -= 8; em(PSHF); }
+    else if (b[2] == Num && b[4]<<8>>8 == b[4]) { loc -= 8; emi(PSHI,b[4]); }
+    else { rv(b+2); loc -= 8; em(PSHA); }
+    b = (int *)*b;
+  }
+  return t;
+}
+
+// can return f(...) hand f this frame?  only if f is named and its arguments fit over the parameters
+// this function declares.  rv() then compiles it with tcall set
+int tailok(int *a)
+{
+  int i, *b;
+  if (*a != Fcall || (*(int *)a[1] != Fun && *(int *)a[1] != FFun)) return 0;
+  for (i = 0, b = (int *)a[2]; b; b = (int *)*b) i++;
+  return i <= fargs;
+}
+
+// finish a tail call once its t bytes of arguments are pushed: copy them over our own, drop the
+// frame and jump to f, which returns straight to our caller
+void tailcall(int *a, int t)
+{
+  int i, m, *b; ident_t *n;
+
+  for (m = 0, i = t/8, b = (int *)a[2]; b; b = (int *)*b) if (--i, b[1] == DOUBLE || b[1] == FLOAT) m |= 1 << i;
+  for (i = 0; i < t/8; i++) { // first argument first, it may still be in a register
+    if (m & 1 << i) { eml(LLD, loc + i*8); eml(SLD, i*8 + 8); }
+    else { eml(LL, loc + i*8); eml(SL, i*8 + 8); }
+  }
+  if (loc) emi(ENT, -loc);
+  loc += t;
+  a = (int *)a[1];
+  if (*a == FFun) { n = (ident_t *)a[2]; *pfix++ = ip; *pfix++ = (int)n; n->val = emf(JMP, n->val); }
+  else emj(JMP, a[2]);
+}
+
+// peephole optimizer
+enum { P_BR = 1, P_TEXT, P_FWD, P_DATA, P_BSS }; // operands the pass must relocate
+enum { PA = 1, PB = 2, PC = 4, PF = 8, PG = 16, PM = 32, PX = 64 }; // what an instruction writes
+
+int *pw, *pk, *pto, *pref, *pdel, *pnp, *psp, pn; // words, operand kinds, targets, references, deleted, new positions, stack
+int pok, psn; // stack followed, walk stack size
+
+int plive(int t) { while (t < pn && pdel[t]) t++; return t; } // first instruction left at or after t
+
+void pkill(int i) { pdel[i] = 1; pref[plive(i+1)] += pref[i]; } // jumps to it now land on its successor
+
+int pinv(int o) { if (o < BLT) return ((o - BZ) & 2) ? o - 2 : o + 2; return (o < BGE) ? o + 3 : o - 3; } // inverse branch
+
+// registers an instruction writes, PM if it stores through a pointer, PX if it could change anything
+int pfx(int o)
+{
+  if ((o >= LL && o <= LHI) || o == LEA || o == LEAG || o == CYC || (o >= ADD && o <= GEF) || o == CDI || o == CDU || o == POPA || o == LAC)
+    return (o == LLD || o == LLF || o == LGD || o == LGF || o == LXD || o == LXF) ? PF : PA;
+  if ((o >= LBL && o <= LBA) || o == POPB || o == LBC)
+    return (o == LBLD || o == LBLF || o == LBGD || o == LBGF || o == LBXD || o == LBXF || o == LBIF) ? PG : PB;
+  if ((o >= ADDF && o <= DIVF) || o == LIF || o == CID || o == CUD || o == POPF || (o >= POW && o <= FMOD)) return PF;
+  if (o == LBAD || o == POPG) return PG;
+  if (o == LCL || o == LCA || o == POPC) return PC;
+  if (o >= MCPY && o <= MSET) return PA | PB | PC | PM;
+  if (o >= SX && o <= SXF) return PM;
+  if ((o >= SL && o <= SGF) || o == ENT || o == LEV || o == JMP || o == JMPI || (o >= BZ && o <= BGEF) ||
+    o == NOP || (o >= PSHA && o <= PSHB) || o == PSHC || o == PSHG) return 0;
+  return PX;
+}
+
+// change an instruction makes to sp
+int pstk(int w)
+{
+  int o = w & 0xff;
+  if (o == ENT) return w >> 8;
+  if ((o >= PSHA && o <= PSHB) || o == PSHC || o == PSHG) return -8;
+  if ((o >= POPB && o <= POPA) || o == POPC || o == POPG) return 8;
+  return 0;
+}
+
+// bytes of the frame an instruction with a local operand touches
+int pwid(int o)
+{
+  switch (o) {
+  case LLC: case LLB: case LBLC: case LBLB: case SLB: return 1;
+  case LLS: case LLH: case LBLS: case LBLH: case SLH: return 2;
+  case LLD: case LBLD: case SLD: return 8;
+  case LL: case LLF: case LBL: case LBLF: case SL: case SLF: case LCL: return 4;
+  }
+  return (o >= ADD && o <= SRUL && (o - ADD) % 3 == 2) ? 4 : 0;
+}
+
+// reach t with sp at d
+void preach(int t, int d)
+{
+  if (!pref[t]) { pref[t] = 1; psp[t] = d; pnp[psn++] = t; }
+  else if (psp[t] != d) pok = 0;
+}
+
+// -r: hold the busiest word of a leaf function's frame in c.  returns a load to put ahead of the function for an argument
+int pcreg()
+{
+  int i, j, o, x, w, n, best;
+  static int slot[64], cnt[64];
+
+  for (i = 0; i < pn; i++) // leaf functions that never take the address of anything in their frame
+    if (!pdel[i] && ((o = pw[i] & 0xff) == LEA || (pfx(o) & (PX | PC)) || (o == JMP && pk[i] != P_BR))) return 0;
+  for (i = 0; i < pn; i++) pref[i] = 1; // weigh by loop nesting
+  for (i = 0; i < pn; i++) if (!pdel[i] && pk[i] == P_BR && pto[i] <= i) for (j = pto[i]; j <= i; j++) pref[j] += 8;
+
+  for (n = i = 0; i < pn; i++) { // words only loaded and stored whole
+    if (pdel[i] || ((o = pw[i] & 0xff) != LL && o != SL && o != LBL)) continue;
+    if ((x = psp[i] + (pw[i] >> 8)) >= 0 && x < 8) continue;
+    for (j = 0; j < n && slot[j] != x; j++) ;
+    if (j == n) { if (n == 64) continue; slot[n] = x; cnt[n++] = 0; }
+    cnt[j] += pref[i];
+  }
+  for (i = 0; i < pn; i++) { // and nothing else
+    if (pdel[i] || (o = pw[i] & 0xff) == LL || o == SL || o == LBL) continue;
+    if ((w = pwid(o))) x = psp[i] + (pw[i] >> 8);
+    else if (pstk(pw[i]) == -8 && o != ENT) { x = psp[i] - 8; w = 8; }
+    else continue;
+    for (j = 0; j < n; j++) if (slot[j] + 4 > x && slot[j] < x + w) cnt[j] = 0;
+  }
+  for (best = -1, j = 0; j < n; j++) if (cnt[j] > (slot[j] >= 8 ? 16 : 1) && (best < 0 || cnt[j] > cnt[best])) best = j;
+  if (best < 0) return 0;
+
+  x = slot[best];
+  for (i = 0; i < pn; i++) {
+    if (pdel[i] || psp[i] + (pw[i] >> 8) != x) continue;
+    switch (pw[i] & 0xff) {
+    case LL:  pw[i] = LAC; break;
+    case SL:  pw[i] = LCA; break;
+    case LBL: pw[i] = LBC; break;
+    }
+  }
+  return (x >= 8) ? LL | x << 8 : 0;
+}
+
+// rework the function just compiled at s, then lay it out again over anything dropped
+void peep(int s)
+{
+  int i, j, t, o, c, d, k, ch, lea, pre, r[4], *p, *q, *tab;
+  ident_t *v;
+
+  if ((pn = (ip - s) >> 2) >= PEEP_SZ) return;
+  if (!pw) {
+    pw = new(PEEP_SZ*4); pk = new(PEEP_SZ*4); pto = new(PEEP_SZ*4); pref = new(PEEP_SZ*4+4);
+    pdel = new(PEEP_SZ*4); pnp = new(PEEP_SZ*4+4); psp = new(PEEP_SZ*4);
+  }
+
+  // decode, giving up on anything unexpected
+  for (i = 0; i < pn; i++) { pw[i] = ((int *)s)[i]; pk[i] = pto[i] = pdel[i] = 0; }
+  for (p = pdata; p > patchdata && p[-1] >= s; ) { p--; pk[(*p - s) >> 2] = P_DATA; }
+  for (p = pbss; p > patchbss && p[-1] >= s; ) { p--; pk[(*p - s) >> 2] = P_BSS; }
+  for (p = fix; p < pfix; p += 2) {
+    i = (*p - s) >> 2;
+    if (p[1] > 0) { pk[i] = P_FWD; continue; }
+    pto[i] = -p[1];
+    for (tab = (int *)(gs + (pw[i] >> 8)), c = 0; c < pto[i]; c++) if ((uint)(i + 1 + (tab[c] >> 2)) >= pn) return;
+  }
+  for (i = 0; i < pn; i++) {
+    o = pw[i] & 0xff;
+    if ((o == JMP || (o >= BZ && o <= BGEF)) && !pk[i]) {
+      if ((uint)(pto[i] = i + 1 + (pw[i] >> 10)) < pn) pk[i] = P_BR;
+      else if (o == JMP) { pk[i] = P_TEXT; pto[i] = s + i*4 + 4 + (pw[i] >> 8); } // a tail call
+      else return;
+    }
+    else if ((o == JSR || o == LEAG) && !pk[i]) { pk[i] = P_TEXT; pto[i] = s + i*4 + 4 + (pw[i] >> 8); }
+  }
+
+  do {
+    ch = 0;
+
+    // drop what can't be reached from the entry, following sp on the way
+    for (i = 0; i <= pn; i++) pref[i] = 0;
+    pok = 1; psn = 0;
+    preach(0, 0);
+    while (psn) {
+      i = pnp[--psn];
+      o = pw[i] & 0xff;
+      d = psp[i];
+      if (!pdel[i]) {
+        if (o == SSP) pok = 0;
+        d += pstk(pw[i]);
+        if (pk[i] == P_BR) preach(pto[i], d);
+        if (o == JMPI && pk[i] == P_DATA) for (tab = (int *)(gs + (pw[i] >> 8)), c = 0; c < pto[i]; c++) preach(i + 1 + (tab[c] >> 2), d);
+      }
+      if ((pdel[i] || (o != JMP && o != JMPI && o != LEV)) && i + 1 < pn) preach(i + 1, d);
+    }
+    for (i = 0; i < pn; i++) if (!pdel[i] && !pref[i]) { pdel[i] = 1; ch = 1; }
+
+    // count the jumps landing on each instruction
+    for (i = 0; i <= pn; i++) pref[i] = 0;
+    for (i = 0; i < pn; i++) {
+      if (pdel[i]) continue;
+      if (pk[i] == P_BR) pref[plive(pto[i])]++;
+      else if ((pw[i] & 0xff) == JMPI) for (tab = (int *)(gs + (pw[i] >> 8)), c = 0; c < pto[i]; c++) pref[plive(i + 1 + (tab[c] >> 2))]++;
+    }
+
+    for (i = 0; i < pn; i = j) {
+      j = plive(i + 1);
+      if (pdel[i]) continue;
+      o = pw[i] & 0xff;
+      if (pk[i] == P_BR) {
+        for (t = plive(pto[i]), c = 0; t < pn && (pw[t] & 0xff) == JMP && pk[t] == P_BR && t != i && c < pn; c++) t = plive(pto[t]); // thread jump chains
+        if (t != pto[i]) { pto[i] = t; ch = 1; }
+        if (t == j) { pkill(i); ch = 1; } // jump to next
+        else if (o == JMP && t < pn && (pw[t] & 0xff) == LEV) { pw[i] = pw[t]; pk[i] = 0; ch = 1; } // jump to return -> return
+        else if (o != JMP && j < pn && (pw[j] & 0xff) == JMP && pk[j] == P_BR && !pref[j] && t == plive(j + 1)) { // Bcc L1; JMP L2; L1: -> B!cc L2
+          pw[i] = pinv(o); pto[i] = pto[j]; pkill(j); ch = 1;
+        }
+      }
+      else if (j >= pn || pref[j]) continue;
+      else if (o == ENT && (pw[j] & 0xff) == ENT) { // ENT s; ENT t -> ENT s+t
+        pw[j] = ENT | ((pw[j] >> 8) + (pw[i] >> 8)) << 8; pkill(i); if (!(pw[j] >> 8)) pkill(j); ch = 1;
+      }
+      else if (o == ENT && (pw[j] & 0xff) == LEV) { pw[j] = LEV | ((pw[j] >> 8) + (pw[i] >> 8)) << 8; pkill(i); ch = 1; } // ENT t; LEV n -> LEV n+t
+      else if (pw[i] == (ENT | 8 << 8) && (pw[j] & 0xff) == PSHA) { pw[j] = SL; pkill(i); ch = 1; } // ENT 8; PSHA -> SL 0
+      else if (pw[i] == (ENT | 8 << 8) && (pw[j] & 0xff) == PSHF) { pw[j] = SLD; pkill(i); ch = 1; }
+      else if (pw[j] >> 8 == pw[i] >> 8 && pk[j] == pk[i] && // store then load back
+        ((o == SL && (pw[j] & 0xff) == LL) || (o == SLD && (pw[j] & 0xff) == LLD) ||
+         (o == SG && (pw[j] & 0xff) == LG) || (o == SGD && (pw[j] & 0xff) == LGD))) { pkill(j); ch = 1; }
+    }
+    if (ch || !pok) continue;
+
+    // once the rest settles, drop loads of frame words a register already holds (r[] = a, b, f, g)
+    for (lea = i = 0; i < pn; i++) if (!pdel[i] && (pw[i] & 0xff) == LEA) lea = 1;
+    r[0] = r[1] = r[2] = r[3] = 1; // odd: nothing known
+    for (i = 0; i < pn; i++) {
+      if (pdel[i]) continue;
+      if (pref[i]) r[0] = r[1] = r[2] = r[3] = 1;
+      o = pw[i] & 0xff;
+      t = psp[i] + (pw[i] >> 8);
+      switch (o) {
+      case LL: k = 0; break;
+      case LBL: k = 1; break;
+      case LLD: k = 2; break;
+      case LBLD: k = 3; break;
+      case LBA: r[1] = r[0]; continue;
+      case LBAD: r[3] = r[2]; continue;
+      default: k = -1;
+      }
+      if (k >= 0) {
+        if (r[k] == t) { pkill(i); ch = 1; } else r[k] = t;
+        continue;
+      }
+      if ((o >= SL && o <= SLF) || pstk(pw[i]) == -8) { // a store into the frame
+        if (!(o >= SL && o <= SLF)) t = psp[i] - 8;
+        for (k = 0; k < 4; k++) if (!(r[k] & 1) && r[k] - t < 8 && t - r[k] < 8) r[k] = 1;
+        if (o == SL || o == PSHA) r[0] = t; else if (o == SLD || o == PSHF) r[2] = t;
+      }
+      if ((d = pstk(pw[i])) > 0) for (k = 0; k < 4; k++) if (!(r[k] & 1) && r[k] < psp[i] + d) r[k] = 1; // popped
+      t = pfx(o);
+      if ((t & PX) || ((t & PM) && lea)) r[0] = r[1] = r[2] = r[3] = 1;
+      if (t & PA) r[0] = 1;
+      if (t & PB) r[1] = 1;
+      if (t & PF) r[2] = 1;
+      if (t & PG) r[3] = 1;
+    }
+  } while (ch);
+
+  // lay the function out again
+  pre = (creg && pok) ? pcreg() : 0;
+  for (i = 0, c = pre ? 2 : 0; i < pn; i++) { pnp[i] = c; if (!pdel[i]) c++; }
+  pnp[pn] = c;
+  for (i = 0; i < pn; i++) {
+    o = pw[i];
+    switch (pk[i]) {
+    case P_BR: o = (o & 0xff) | (pnp[pto[i]] - pnp[i] - 1) << 10; break;
+    case P_TEXT: if ((t = pto[i]) > s) t = s + pnp[(t - s) >> 2] * 4; o = (o & 0xff) | (t - s - pnp[i]*4 - 4) << 8; break;
+    case P_FWD: // forward function chains link through the operands
+      if ((t = o >> 8) && t >= s - ts) t = pto[(t - s + ts) >> 2];
+      o = (o & 0xff) | t << 8;
+      pto[i] = pdel[i] ? t : s - ts + pnp[i]*4;
+      break;
+    }
+    if (!pdel[i]) ((int *)s)[pnp[i]] = o;
+  }
+  if (pre) { ((int *)s)[0] = pre; ((int *)s)[1] = LCA; }
+  for (p = fix; p < pfix; p += 2) {
+    i = (*p - s) >> 2;
+    if (p[1] > 0) { v = (ident_t *)p[1]; if (v->val == *p - ts) v->val = pto[i]; }
+    else if (!pdel[i]) for (tab = (int *)(gs + (pw[i] >> 8)), c = 0; c < pto[i]; c++) tab[c] = (pnp[i + 1 + (tab[c] >> 2)] - pnp[i] - 1) * 4;
+  }
+  for (p = pdata; p > patchdata && p[-1] >= s; p--) ;
+  for (q = p; p < pdata; p++) if (!pdel[i = (*p - s) >> 2]) *q++ = s + pnp[i]*4;
+  pdata = q;
+  for (p = pbss; p > patchbss && p[-1] >= s; p--) ;
+  for (q = p; p < pbss; p++) if (!pdel[i = (*p - s) >> 2]) *q++ = s + pnp[i]*4;
+  pbss = q;
+  if (symmap) for (p = psmap - 3; p >= smap && p[0] > s - ts; p -= 3) p[0] = s - ts + pnp[(p[0] - s + ts) >> 2]*4;
+  if (debug && pnp[pn] != pn) printf("peephole: %d instructions in, %d out\n", pn, pnp[pn]);
+  ip = s + pnp[pn]*4;
+  if (pnp[pn] < pn) memset((void *)ip, 0, (pn - pnp[pn])*4);
+}
+
+// inlining
+int *pfind(int *p, int *q, int s) // first patch at or after s
+{
+  int *m;
+  while (p < q) { m = p + (q - p) / 2; if (*m < s) p = m + 1; else q = m; }
+  return p;
+}
+
+// instructions in the function just compiled at s if its code can be copied in place of a call, else 0
+int inlsz(int s, int max)
+{
+  int i, n, o, *p, *q;
+
+  if ((n = (ip - s) >> 2) > max || (*(int *)(ip - 4) & 0xff) != LEV) return 0;
+  for (p = fix; p < pfix; p += 2) if (p[1] > 0) return 0; // tail calls to functions still to come
+  p = pfind(patchdata, pdata, s); q = pfind(patchbss, pbss, s);
+  for (i = 0; i < n - 1; i++) {
+    o = ((int *)s)[i] & 0xff;
+    if (o == LEV && ((int *)s)[i] != *(int *)(ip - 4)) return 0;
+    if (o == JMP && (uint)(i + 1 + (((int *)s)[i] >> 10)) >= n) return 0; // or any other
+    if (o == JSR || o == JSRA || o == JMPI || o == SSP || o == RTI) return 0;
+    if (p < pdata && *p == s + i*4) p++;
+    else if (q < pbss && *q == s + i*4) q++;
+    else if (o == LEAG) return 0; // a text address
+  }
+  return n;
+}
+
+// copy in a small function's code for a call to it.  sp drops by 8 where JSR would push the return
+// address so the frame is laid out just the same, the last LEV becomes ENT and the others jump to it
+void inlcall(int s, int n)
+{
+  int w, *p, *q;
+
+  p = pfind(patchdata, pdata, s); q = pfind(patchbss, pbss, s);
+  emi(ENT,-8);
+  for (; --n; s += 4) {
+    if (p < pdata && *p == s) { p++; *pdata++ = ip; }
+    else if (q < pbss && *q == s) { q++; *pbss++ = ip; }
+    w = *(int *)s;
+    if ((w & 0xff) == LEV) emi(JMP, (n - 1) * 4); else emi(w & 0xff, w >> 8);
+  }
+  emi(ENT, (*(int *)s >> 8) + 8);
+}
+
+// switch
+void swsort(int *c, int n) // cases {value, ip} by value
+{
+  int i, j, v, w;
+  for (i = 2; i < n*2; i += 2) {
+    v = c[i]; w = c[i+1];
+    for (j = i; j && c[j-2] > v; j -= 2) { c[j] = c[j-2]; c[j+1] = c[j-1]; }
+    c[j] = v; c[j+1] = w;
+  }
+}
+
+// dispatch on a to the n sorted cases at c, else to d.  dense cases get a jump table, a few cases
+// a list of compares, and anything else is split in two by value
+void swtch(int *c, int n, int d)  // XXX lots of possible signed/unsigned under/overflow issues in this block
+{
+  int i, j, m, t, cmin, cmax;
+
+  cmin = c[0]; cmax = c[n*2-2];
+  if (n >= 4 && (uint)(cmax - cmin) <= n*16) { // jump table
+    if (cmin > 0 && cmax <= n*8) cmin = 0;
+    else if (cmin) { opi(SUB, cmin); cmax -= cmin; }
+    lbi(++cmax);
+    data = (data + 3) & -4;
+    emj(BGEU, d); emg(JMPI, data);
+    *pfix++ = ip - 4; *pfix++ = -cmax;
+    for (i = 0; i < cmax; ) ((int *)(gs + data))[i++] = d - ip;
+    for (i = 0; i < n*2; i += 2) ((int *)(gs + data))[c[i] - cmin] = c[i+1] - ip;
+    data += cmax * 4;
+  } else if (n <= 3) { // jump list
+    for (i = 0; i < n*2; i += 2) { lbi(c[i]); emj(BE, c[i+1]); }
+    emj(JMP, d);
+  } else {
+    for (m = n/2, t = n, i = 1, j = 0; i < n; i++) { // split between dense runs, as near the middle as possible
+      if ((uint)(c[i*2] - c[j*2]) <= (i - j + 1) * 16) continue;
+      if ((i*2 - n) * (i*2 - n) < t) { m = i; t = (i*2 - n) * (i*2 - n); }
+      j = i;
+    }
+    lbi(c[m*2]); t = emf(BLT, 0);
+    swtch(c + m*2, n - m, d);
+    patch(t, ip);
+    swtch(c, m, d);
+  }
+}
+
+// loop optimizer: a scan of the source ahead of the parser says what a loop body can disturb
+
+int idch(int c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$'; }
+
+ident_t *look(char *p, int b) // the identifier of b characters at p, found as next() would
+{
+  int h, i; ident_t *v;
+  for (h = *p, i = 1; i < b; i++) h = h * 147 + p[i];
+  for (v = ht[h & (HASH_SZ - 1)], h ^= b; v; v = v->next)
+    if (h == v->hash && (b < 5 || !memcmp(v->name, p, b))) return v;
+  return 0;
+}
+
+void ladd(ident_t **l, int *n, ident_t *v) // a list that overflows holds everything
+{
+  int i;
+  if (!v || *n > LOOP_SZ) return;
+  for (i = 0; i < *n; i++) if (l[i] == v) return;
+  if (*n < LOOP_SZ) l[(*n)++] = v; else *n = LOOP_SZ + 1;
+}
+
+int lfind(ident_t **l, int n, int c, int v) // is the variable of class c at v on the list?
+{
+  if (n > LOOP_SZ) return 1;
+  while (n--) if (l[n]->class == c && l[n]->val == v) return 1;
+  return 0;
+}
+
+char *lskip(char *p) // past white space and comments
+{
+  for (;;) {
+    if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\v' || *p == '\f') p++;
+    else if (*p == '/' && p[1] == '/') { while (*p && *p != '\n') p++; }
+    else if (*p == '/' && p[1] == '*') { for (p += 2; *p && (*p != '*' || p[1] != '/'); p++) ; if (*p) p += 2; }
+    else return p;
+  }
+}
+
+// scan from p to the '}' ending a block, or with end ';' to the end of a statement.
+// returns 0 for anything it can't follow
+int lscan(char *p, int end)
+{
+  int c, d, t, i, k, pre, w[6], sw[8], nsw, swd; char *q; ident_t *v, *wv[6];
+
+  lstn = ladn = lbn = lcall = lmem = lgoto = lcase = nsw = 0;
+  swd = -1; // depth of a switch whose body is yet to open, sw[] depths inside those open
+  for (i = 0; i < 6; i++) { w[i] = 0; wv[i] = 0; }
+  for (d = pre = 0; ; ) {
+    v = 0;
+    switch (c = *p++) {
+    case 0: case '#': return 0;
+    case ' ': case '\t': case '\n': case '\r': case '\v': case '\f': continue;
+    case '/':
+      if (*p == '/') { while (*p && *p != '\n') p++; continue; }
+      if (*p == '*') { for (p++; *p && (*p != '*' || p[1] != '/'); p++) ; if (!*p) return 0; p += 2; continue; }
+      if (*p == '=') { p++; t = '='; } else t = c;
+      break;
+    case '"': case '\'':
+      while (*p && *p != c) if (*p++ == '\\' && *p) p++;
+      if (!*p++) return 0;
+      t = 'n';
+      break;
+    case '0' ... '9':
+      while (idch(*p) || *p == '.') p++;
+      t = 'n';
+      break;
+    case 'a' ... 'z': case 'A' ... 'Z': case '_': case '$':
+      for (q = p - 1; idch(*p); p++) ;
+      if ((v = look(q, p - q)) && v->mac) return 0; // a macro could hide anything
+      if ((v = look(q, p - q)) && v->tk != Id) { // keyword
+        if (v->tk == Goto) lgoto = 1;
+        else if (v->tk == Switch) swd = d;
+        else if ((v->tk == Case || v->tk == Default) && !nsw) lcase = 1; // a switch outside could jump in past a loop's set up
+        else if (v->tk == Asm || v->tk == Va_start || v->tk == Va_arg || (v->tk == Do && end == ';')) return 0;
+        v = 0; t = 'k';
+      } else t = 'a';
+      break;
+    case '=': case '!': if (*p == '=') { p++; t = 'c'; } else t = c; break;
+    case '<': case '>':
+      if (*p == c) { if (*++p == '=') { p++; t = '='; } else t = 'c'; }
+      else { if (*p == '=') p++; t = 'c'; }
+      break;
+    case '+': case '-':
+      if (*p == c) { p++; t = 'i'; }
+      else if (*p == '=') { p++; t = '='; }
+      else if (c == '-' && *p == '>') { p++; t = '.'; }
+      else t = c;
+      break;
+    case '&': case '|': if (*p == c) { p++; t = 'c'; } else if (*p == '=') { p++; t = '='; } else t = c; break;
+    case '*': case '%': case '^': if (*p == '=') { p++; t = '='; } else t = c; break;
+    case '(': case '[': case '{':
+      if (c == '{' && d == swd) { if (nsw < 8) sw[nsw++] = d + 1; else lcase = 1; swd = -1; }
+      d++; t = c;
+      break;
+    case ')': case ']': case '}':
+      if (c == end && !d) return 1;
+      if (--d < 0) return 0;
+      if (c == '}' && nsw && d < sw[nsw-1]) nsw--;
+      if (c == '}' && end == ';' && !d) goto semi;
+      t = c;
+      break;
+    case ';':
+      if (end == ';' && !d) {
+semi:   p = lskip(p); // a statement runs on past else
+        if (strncmp(p, "else", 4) || idch(p[4])) return 1;
+      }
+      t = c;
+      break;
+    default: t = c; break;
+    }
+
+    if (pre == 3) { if (t == '[' || t == '.' || t == '(') lmem = 1; pre = 0; } // ++x[ ++x. ++x( store to memory
+    else if (pre) {
+      if (t == 'a') { ladd(lst, &lstn, v); if (pre == 2) ladd(lad, &ladn, v); pre = 3; }
+      else { if (pre == 1) lmem = 1; pre = 0; }
+    }
+    switch (t) {
+    case '(': if (w[0] == 'a' || w[0] == ')' || w[0] == ']') lcall = 1; break;
+    case '=': if (w[0] == 'a' && w[1] != '.' && w[1] != '*') ladd(lst, &lstn, wv[0]); else lmem = 1; if (w[0] == ')') ladd(lst, &lstn, wv[1]); break;
+    case 'i':
+      if (w[0] == 'a' && w[1] != '.') ladd(lst, &lstn, wv[0]);
+      else if (w[0] == 'a' || w[0] == ']') lmem = 1;
+      else { lmem = 1; pre = 1; if (w[0] == ')') ladd(lst, &lstn, wv[1]); } // (x)++ or a cast then ++x
+      break;
+    case '&': if (w[0] != 'a' && w[0] != 'n' && w[0] != ']') pre = 2; break; // after ')' it may follow a cast
+    case ']': // x[i] or x[i+n]
+      if (w[1] == '[' && w[0] == 'a') k = 2;
+      else if (w[3] == '[' && w[2] == 'a' && (w[1] == '+' || w[1] == '-') && w[0] == 'n') k = 4;
+      else break;
+      if (!(v = wv[k-2]) || v->class != Auto || v->val != liv || w[k] != 'a' || w[k+1] == '.' || !wv[k]) break;
+      for (i = 0; i < lbn && lbase[i] != wv[k]; i++) ;
+      if (i == lbn && lbn < 4) { lbase[lbn] = wv[k]; lbc[lbn++] = 0; }
+      if (i < lbn) lbc[i]++;
+      v = 0;
+      break;
+    }
+    for (i = 5; i; i--) { w[i] = w[i-1]; wv[i] = wv[i-1]; }
+    w[0] = t; wv[0] = v;
+  }
+}
+
+// can't the loop change a?  or, with pure, is it free of side effects?
+int linv(int *a, int pure)
+{
+  switch (*a) {
+  case Num: case Lea: case Leag: return 1;
+  case Auto: return pure || (a[2] != liv && !lfind(lst, lstn, Auto, a[2]) && ((!lcall && !lmem) || !lfind(fad, fadn, Auto, a[2])));
+  case Static: return pure || (!lcall && !lmem && !lfind(lst, lstn, Static, a[2]));
+  case Ptr: return (pure || (!lcall && !lmem)) && linv(a+2, pure);
+  case Add: case Sub: case Mul: case And: case Or: case Xor: case Shl: case Shr: case Sru:
+    return linv((int *)a[1], pure) && linv((int *)a[2], pure);
+  }
+  return 0;
+}
+
+// is a loop test free of side effects, so it can't step the local behind the pointers' back?
+int ltest(int *a)
+{
+  switch (*a) {
+  case Eq: case Ne: case Lt: case Ge: case Ltu: case Geu: return linv((int *)a[1], 1) && linv((int *)a[2], 1);
+  case Lan: case Lor: return ltest((int *)a[1]) && ltest(a+2);
+  case Not: return ltest(a+2);
+  }
+  return linv(a, 1);
+}
+
+// ahead of a for loop with test c (or 0) and step s, hold a pointer to each array the body
+// indexes with the stepped local and load a bound of the test that can't change.  returns
+// the bytes of frame these take
+int lopt(int *c, int *s)
+{
+  int i, j, k, n, h, st, *a, *b, *d, *es; ident_t *v; char *p;
+
+  if (*s >= Cic && *s <= Cus) s += 2;
+  if (*s == Add && *(int *)s[2] == Num) s = (int *)s[1]; // x++
+  if ((*s != Adda && *s != Suba) || *(a = (int *)s[1]) != Auto || (a[1] != INT && a[1] != UINT) || s[2] != Num) return 0;
+  if (c && !ltest(c)) return 0;
+  liv = a[2]; st = (*s == Adda) ? s[4] : -s[4];
+
+  if (!fscan) { // once per function, whatever it takes the address of
+    if (lscan(fbody, '}') && !lgoto) { memcpy(fad, lad, sizeof(fad)); fadn = ladn; fscan = 1; } else fscan = -1;
+  }
+  if (fscan < 0 || lfind(fad, fadn, Auto, liv)) return 0;
+  if (tk == '{') p = pos;
+  else if (tk == ';') p = pos - 1;
+  else if (tk == Id || tk == Return || tk == Break || tk == Continue || tk == If || tk == For || tk == While || tk == Switch)
+    for (p = pos; idch(p[-1]); p--) ;
+  else return 0;
+  if (!lscan(p, (tk == '{') ? '}' : ';') || lcase || lfind(lst, lstn, Auto, liv)) return 0;
+
+  for (n = lqn, i = 0; i < lbn && lqn < LQ_SZ*6; i++) {
+    v = lbase[i];
+    if (v->class == Auto) { if (!(v->type & PMASK) || lbc[i] < 2 || lfind(lst, lstn, Auto, v->val) || ((lcall || lmem) && lfind(fad, fadn, Auto, v->val))) continue; } // p[i] alone is cheap
+    else if (v->class != Lea && v->class != Leag) continue;
+    if ((k = tinc(v->type)) <= 0) continue;
+    lq[lqn] = v->class; lq[lqn+1] = v->val; lq[lqn+2] = k; lq[lqn+3] = liv; lq[lqn+5] = st; lqn += 6;
+  }
+  h = 0;
+  if (c && (*c == Eq || *c == Ne || *c == Lt || *c == Ge || *c == Ltu || *c == Geu)) {
+    for (i = 1; i < 3; i++) {
+      b = (int *)c[i];
+      if (*b != Num && *b != Auto && *b != Static && *b != Lea && *b != Leag && linv(b, 0) && linv((int *)c[3-i], 1)) h |= i;
+    }
+  }
+  if (!(k = (lqn - n) / 6 * 8 + ((h & 1) + (h >> 1)) * 8)) return 0;
+
+  emi(ENT, -k); loc -= k;
+  es = e;
+  for (j = loc, i = n; i < lqn; i += 6, j += 8) { // pointer = &x[i]
+    lq[i+4] = j;
+    node(lq[i], (int *)INT, (int *)lq[i+1]); b = e;
+    node(Auto, (int *)INT, (int *)liv); d = e;
+    *(e-=4) = Num; e[2] = lq[i+2];
+    mul(d);
+    add((uint *)b);
+    rv(e);
+    eml(SL, j);
+    e = es;
+  }
+  for (i = 1; i < 3; i++) {
+    if (!(h & i)) continue;
+    b = (int *)c[i];
+    rv(b);
+    eml(SL, j);
+    b[0] = Auto; b[1] = INT; b[2] = j; j += 8;
+  }
+  return k;
+}
+
+// &x[i] or &x[i+n] for a pointer a loop keeps, else 0
+int *lidx(int *b, int k)
+{
+  int i, c, *a;
+  for (i = lqn - 6; i >= 0; i -= 6) {
+    if (*b != lq[i] || b[2] != lq[i+1] || k != lq[i+2]) continue;
+    if (*e == Auto && e[2] == lq[i+3]) c = 0;
+    else if (*e == Add && *(a = (int *)e[1]) == Auto && a[2] == lq[i+3] && *(int *)e[2] == Num) c = ((int *)e[2])[2];
+    else continue;
+    node(Auto, (int *)INT, (int *)lq[i+4]);
+    if (c) { a = e; *(e-=4) = Num; e[2] = c * k; add((uint *)a); }
+    return e;
+  }
+  return 0;
+}
+
 // statement
 void stmt()
 {
-  static int brk, cont, def;
-  int a, b, c, d, *es, *et, cmin, cmax;
+  static int brk, cont, def, loop;
+  int a, b, c, d, l, m, *es, *et;
 
   switch (tk) {
   case If:
@@ -1925,7 +3071,7 @@ void stmt()
     next(); skip(Paren);
     expr(Comma); if (ty == DOUBLE || ty == FLOAT) *(e-=2) = Nzf;
     skip(')');
-    stmt();
+    loop++; stmt(); loop--;
     patch(cont,ip); cont = c;
     patch(test(e,0), a);
     e = es;
@@ -1938,6 +3084,7 @@ void stmt()
       es = e;
       expr(Comma);
       cast(rt);
+      if (ftail && !loop && tailok(e)) tcall = 1;
       rv(e);
       e = es;
     }
@@ -1970,14 +3117,17 @@ void stmt()
     skip(';');
     if (tk != ')') { et = e; expr(Comma); }
     skip(')');
+    l = lqn;
+    m = et ? lopt(es ? et : 0, e) : 0;
     if (es) d = emf(JMP, 0);
     a = ip;
     b = brk; brk = 0;
     c = cont; cont = 0;
-    stmt();
+    loop++; stmt(); loop--;
     patch(cont, (es || et) ? ip : a);
     cont = c;
     if (et) { trim(); rv(e); e = et; }
+    for (; lqn > l; lqn -= 6) { eml(LL, lq[lqn-2]); opi(ADD, lq[lqn-1] * lq[lqn-4]); eml(SL, lq[lqn-2]); } // step the pointers
     if (es) {
       patch(d,ip);
       patch(test(e,0), a);
@@ -1985,6 +3135,7 @@ void stmt()
     } else
       emj(JMP, a);
     patch(brk,ip); brk = b;
+    if (m) { emi(ENT, m); loc += m; }
     return;
 
   case Do:
@@ -1992,7 +3143,7 @@ void stmt()
     b = brk; brk = 0;
     c = cont; cont = 0;
     a = ip;
-    stmt();
+    loop++; stmt(); loop--;
     patch(cont,ip); cont = c;
     skip(While); skip(Paren);
     es = e;
@@ -2015,29 +3166,13 @@ void stmt()
     d = def; def = 0;
     es = e;
     stmt();
-    brk = emf(JMP, brk);
+    c = ip; brk = emf(JMP, brk);
     patch(a,ip);
     if (es == e) { //err("no case in switch statement");   XXX
       if (def) emj(JMP, def);
-    } else {  // XXX lots of possible signed/unsigned under/overflow issues in this block
-      cmin = cmax = *(et = es - 2);
-      while (et > e) { et -= 2; if ((c = *et) > cmax) cmax = c; else if (c < cmin) cmin = c; }
-      et = es;
-      if ((uint)(cmax - cmin) <= ((int)es - (int)e)*2) { // jump table
-        if (cmin > 0 && cmax <= (int)es - (int)e) cmin = 0;
-        else if (cmin) { opi(SUB, cmin); cmax -= cmin; }
-        lbi(++cmax);
-        data = (data + 3) & -4;
-        if (def) { emj(BGEU, def); emg(JMPI, data); def -= ip; }
-        else { brk = emf(BGEU, brk); emg(JMPI, data); }
-        for (c = 0; c < cmax; ) ((int *)(gs + data))[c++] = def;
-        while (et > e) { et -= 2; ((int *)(gs + data))[*et - cmin] = et[1] - ip; }
-        data += cmax * 4;
-      } else { // jump list
-//        printf("jump list at line %d\n",line);
-        while (et > e) { et -= 2; lbi(*et); emj(BE, et[1]); }  // XXX overflow issues?
-        if (def) emj(JMP, def);
-      }
+    } else {
+      swsort(e, (es - e) / 2);
+      swtch(e, (es - e) / 2, def ? def : c); // no default: on to the jump out of the body
     }
     def = d;
     e = es;
@@ -2057,6 +3192,7 @@ void stmt()
     return;
 
   case Asm:
+    ftail = 0;
     next();
     skip(Paren);
     a = imm();
@@ -2117,6 +3253,7 @@ void stmt()
     if (*pos == ':') {
       pos++;
       //printf("+ + + processing label\n");  // XXX put on local list if 0 or global
+      ftail = 0; // a goto back here could take a frame address the tail call can't see
       if (!id->class) {
         ploc->class = 0;
         ploc->id = id;
@@ -2143,25 +3280,106 @@ void stmt()
   }
 }
 
+// write the symbol map next to the executable
+void writemap(char *outfile)
+{
+  int f, *p, n; char *name, *s;
+  name = new(strlen(outfile) + 5);
+  strcpy(name, outfile); strcat(name, ".map");
+  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC)) < 0) { dprintf(2,"%s : error: can't open map file %s\n", cmd, name); return; }
+  for (p = smap; p < psmap; p += 3) {
+    if (p[1]) { dprintf(f, "%08x L %d %s\n", p[0], p[1], (char *)p[2]); continue; }
+    for (s = ((ident_t *)p[2])->name, n = 0; (s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z') ||
+      (s[n] >= '0' && s[n] <= '9') || s[n] == '_' || s[n] == '$'; n++) ;
+    dprintf(f, "%08x F %.*s\n", p[0], n, s);
+  }
+  close(f);
+}
+
+// write an object file for ld: text and data unpatched, the functions defined and needed,
+// and the instructions addressing data, bss or a needed function.  static functions stay
+// private like every other global
+void writeobj(char *outfile)
+{
+  int f, i, n, t, ns, nr, str, *p, *sym, *rel; ident_t *v; char *names;
+  struct { uint magic, text, data, bss, nsym, nrel, str; } hdr;
+
+  if (!outfile) {
+    outfile = new(strlen(file) + 3);
+    strcpy(outfile, file);
+    if ((n = strlen(outfile)) > 2 && outfile[n-2] == '.') n -= 2;
+    strcpy(outfile + n, ".o");
+  }
+  for (ns = str = i = 0; i < HASH_SZ; i++) {
+    for (v = ht[i]; v; v = v->next) {
+      if (v->class != Fun && (v->class != FFun || !v->val)) continue;
+      for (n = 0; idch(v->name[n]); n++) ;
+      if (!v->priv) { ns++; str += n + 1; }
+      else if (v->class == FFun) { dprintf(2,"%s : error: static function %.*s not defined\n", cmd, n, v->name); errs++; }
+    }
+  }
+  if (errs) return;
+  if ((f = open(outfile, O_WRONLY | O_CREAT | O_TRUNC)) < 0) { dprintf(2,"%s : error: can't open output file %s\n", cmd, outfile); errs++; return; }
+  sym = new(ns * 8);
+  names = new(str);
+  rel = new((pdata - patchdata + pbss - patchbss) * 8 + (ip - ts) * 2);
+  nr = 0;
+  for (p = patchdata; p < pdata; p++) { rel[nr++] = *p - ts; rel[nr++] = -1; }
+  for (p = patchbss;  p < pbss;  p++) { rel[nr++] = *p - ts; rel[nr++] = -2; }
+  for (ns = str = i = 0; i < HASH_SZ; i++) {
+    for (v = ht[i]; v; v = v->next) {
+      if (v->priv) continue;
+      if (v->class == Fun) sym[ns*2] = v->val - ts;
+      else if (v->class == FFun && v->val) { // unchain the forward references
+        sym[ns*2] = -1;
+        for (t = v->val; t; t = n >> 8) { n = *(int *)(ts + t); *(int *)(ts + t) = n & 0xff; rel[nr++] = t; rel[nr++] = ns; }
+      }
+      else continue;
+      sym[ns++*2+1] = str;
+      for (n = 0; idch(v->name[n]); n++) names[str++] = v->name[n];
+      names[str++] = 0;
+    }
+  }
+  hdr.magic = 0xC0DE0B1E;
+  hdr.text  = ip - ts;
+  hdr.data  = data;
+  hdr.bss   = bss;
+  hdr.nsym  = ns;
+  hdr.nrel  = nr / 2;
+  hdr.str   = str;
+  write(f, &hdr, sizeof(hdr));
+  write(f, (void *) ts, ip - ts);
+  write(f, (void *) gs, data);
+  write(f, sym, ns * 8);
+  write(f, rel, nr * 4);
+  write(f, names, str);
+  close(f);
+}
+
 int main(int argc, char *argv[])
 {
-  int i, amain, text, *patchdata, *patchbss, sbrk_start;
+  int i, amain, text, sbrk_start, version, nd;
   ident_t *tmain;
-  char *outfile;
+  char *outfile, *cache, *p, *dv[16]; // -D definitions
   struct { uint magic, bss, entry, flags; } hdr;
   struct stat st;
 
   cmd = *argv;
   if (argc < 2) goto usage;
-  outfile = 0;
+  outfile = cache = 0; nd = 0;
   file = *++argv;
   while (--argc && *file == '-') {
     switch (file[1]) {
     case 'v': verbose = 1; break;
     case 's': debug = 1; break;
+    case 'r': creg = 1; break;
+    case 'g': symmap = 1; break;
+    case 'c': object = 1; break;
     case 'I': incl = file + 2; break;
-    case 'o': if (argc > 1) { outfile = *++argv; argc--; break; }
-    default: usage: dprintf(2,"usage: %s [-v] [-s] [-Ipath] [-o exefile] file ...\n", cmd); return -1;
+    case 'D': if (nd < 16) dv[nd++] = file + 2; break;
+    case 'o': if (argc > 1) { outfile = *++argv; argc--; break; } goto usage;
+    case 'k': if (argc > 2) { cache = *++argv; version = atoi(*++argv); argc -= 2; break; }
+    default: usage: dprintf(2,"usage: %s [-v] [-s] [-r] [-g] [-c] [-Ipath] [-Dname[=value]] [-o exefile] [-k exefile version] file ...\n", cmd); return -1;
     }
     file = *++argv;
   }
@@ -2173,11 +3391,16 @@ int main(int argc, char *argv[])
 
   bigend = 1; bigend = ((char *)&bigend)[3];
 
-  pos = "asm auto break case char continue default do double else enum float for goto if int long return short "
-        "sizeof static struct switch typedef union unsigned void while va_list va_start va_arg main";
+  pos = "asm auto break case char continue default do double else enum float for goto if inline int long return short "
+        "sizeof static struct switch typedef union unsigned void while va_list va_start va_arg main defined";
+  pin = ins;
+  mbuf = mtop = new(MAC_SZ);
   for (i = Asm; i <= Va_arg; i++) { next(); id->tk = i; }
   next();
   tmain = id;
+  next();
+  pdefined = id;
+  for (i = 0; i < nd; i++) ppcmd(dv[i]);
 
   line = 1;
   if (stat(file, &st)) { dprintf(2,"%s : [%s:%d] error: can't stat file %s\n", cmd, file, line, file); return -1; } // XXX fstat inside mapfile?
@@ -2186,13 +3409,16 @@ int main(int argc, char *argv[])
   e = new(EXPR_SZ) + EXPR_SZ;
   pdata = patchdata = new(PSTACK_SZ);
   pbss  = patchbss  = new(PSTACK_SZ);
+  fix   =             new(PSTACK_SZ);
   ploc  =             new(LSTACK_SZ);
+  if (symmap) psmap = smap = new(SMAP_SZ);
 
   if (verbose) dprintf(2,"%s : compiling %s\n", cmd, file);
   if (debug) dline();
+  if (symmap) mapline();
   next();
   decl(Static);
-  if (!errs && ffun) err("unresolved forward function (retry with -v)");
+  if (!errs && ffun && !object) err("unresolved forward function (retry with -v)");
 
   ip = (ip + 7) & -8;
   text = ip - ts;
@@ -2200,12 +3426,13 @@ int main(int argc, char *argv[])
   bss = (bss + 7) & -8;
 
   if (text + data + bss > SEG_SZ) err("text + data + bss segment exceeds maximum size");
-  if (!(amain = tmain->val)) err("main() not defined");
+  if (!(amain = tmain->val) && !object) err("main() not defined");
 
   if (verbose || errs) dprintf(2,"%s : %s compiled with %d errors\n", cmd, file, errs);
   if (verbose) dprintf(2,"entry = %d text = %d data = %d bss = %d\n", amain - ts, text, data, bss);
 
-  if (!errs && !debug) {
+  if (!errs && !debug && object) writeobj(outfile);
+  else if (!errs && !debug) {
     while (pdata != patchdata) { pdata--; *(int *)*pdata += (ip        - *pdata - 4) << 8; }
     while (pbss  != patchbss ) { pbss--;  *(int *)*pbss  += (ip + data - *pbss  - 4) << 8; }
     if (outfile) {
@@ -2219,7 +3446,27 @@ int main(int argc, char *argv[])
       write(i, (void *) ts, text);
       write(i, (void *) gs, data);
       close(i);
+      if (symmap) writemap(outfile);
     } else {
+      if (cache) { // version last, so exec never finds it on a partial file
+        if ((i = open(cache, O_WRONLY | O_CREAT | O_TRUNC)) < 0) {
+          for (p = cache + strlen(cache); p > cache && *--p != '/'; ) ;
+          if (p > cache) { *p = 0; mkdir(cache); *p = '/'; }
+          i = open(cache, O_WRONLY | O_CREAT | O_TRUNC);
+        }
+        if (i >= 0) {
+          hdr.magic = 0xC0DEF00D;
+          hdr.bss   = bss;
+          hdr.entry = amain - ts;
+          hdr.flags = 0;
+          if (write(i, &hdr, sizeof(hdr)) == sizeof(hdr) && write(i, (void *) ts, text) == text && write(i, (void *) gs, data) == data) {
+            hdr.flags = version;
+            lseek(i, 0, SEEK_SET);
+            write(i, &hdr, sizeof(hdr));
+          }
+          close(i);
+        }
+      }
       memcpy((void *)ip, (void *)gs, data);
       sbrk(sbrk_start + text + data + 8 - (int)sbrk(0)); // free compiler memory
       sbrk(bss);
@@ -1,8 +1,16 @@
 // em -- cpu emulator
 //
-// Usage:  em [-v] [-m memsize] [-f filesys] file
+// Usage:  em [-v] [-p] [-m memsize] [-f filesys] [-s samples [-i cycles]] file
 //
 // Description:
+//   With -s the guest is profiled: every so many cycles (-i, default 16384) the pc is recorded in the
+//   samples file along with the mode, the page directory, and the return addresses found on the stack.
+//   Time spent idle is only counted.  prof turns the samples into a profile.
+//
+//   With -p every instruction is counted by opcode, conditional branches by outcome, and basic blocks
+//   (by address and page directory) by entry.  The counts are reported on the way out, hottest first.
+//   The counting costs a test on every instruction, so it is compiled in only with -DHIST (btools
+//   builds that em as xemp).  Without it -p is refused.
 //
 // Written by Robert Swierczek
 
@@ -16,6 +24,11 @@ enum {
   TB_SZ  =     1024*1024, // page translation buffer array size (4G / pagesize)
   FS_SZ  =   4*1024*1024, // ram file system size (4M)
   TPAGES = 4096,          // maximum cached page translations
+  SBUF_SZ = 64*1024,      // profile sample buffer (words)
+  NSTACK = 32,            // deepest stack recorded in a sample
+  NSCAN  = 1024,          // user stack words scanned for return addresses
+  NHBLK  = 64*1024,       // basic blocks counted by -p (power of 2)
+  NHTOP  = 40,            // hottest basic blocks reported
 };
 
 enum {           // page table entry flags
@@ -54,7 +67,48 @@ uint verbose,    // chatty option -v
   tpages,        // number of cached page translations
   *trk, *twk,    // kernel read/write page transation tables
   *tru, *twu,    // user read/write page transation tables
-  *tr,  *tw;     // current read/write page transation tables
+  *tr,  *tw,     // current read/write page transation tables
+  *sbuf, sn,     // profile samples not yet written -s
+  sint, scount,  // cycles between samples, since the last
+  sidle;         // samples that found the cpu idle
+int sfd;         // profile sample file
+
+#ifdef HIST
+struct hblock {  // -p basic block
+  uint pc, pdir; // start, page directory | user
+  uint n, len;   // entries, longest run of instructions
+  double ins;    // instructions executed in it
+  uint taken;    // times the conditional branch ending it was taken
+} *hblk, *hb;    // table, current block
+uint hist,       // -p histogram option
+  hop[256],      // executions per opcode
+  htaken[256],   // conditional branches taken per opcode
+  hblks, hlost,  // blocks in the table, entries to blocks that did not fit
+  hpc, hi,       // next pc in sequence, instructions so far in the current block
+  hend, hcond;   // last instruction ended a block, was a conditional branch
+
+char ops[] = // as in c.c
+  "HALT,ENT ,LEV ,JMP ,JMPI,JSR ,JSRA,LEA ,LEAG,CYC ,MCPY,MCMP,MCHR,MSET,"
+  "LL  ,LLS ,LLH ,LLC ,LLB ,LLD ,LLF ,LG  ,LGS ,LGH ,LGC ,LGB ,LGD ,LGF ,"
+  "LX  ,LXS ,LXH ,LXC ,LXB ,LXD ,LXF ,LI  ,LHI ,LIF ,"
+  "LBL ,LBLS,LBLH,LBLC,LBLB,LBLD,LBLF,LBG ,LBGS,LBGH,LBGC,LBGB,LBGD,LBGF,"
+  "LBX ,LBXS,LBXH,LBXC,LBXB,LBXD,LBXF,LBI ,LBHI,LBIF,LBA ,LBAD,"
+  "SL  ,SLH ,SLB ,SLD ,SLF ,SG  ,SGH ,SGB ,SGD ,SGF ,"
+  "SX  ,SXH ,SXB ,SXD ,SXF ,"
+  "ADDF,SUBF,MULF,DIVF,"
+  "ADD ,ADDI,ADDL,SUB ,SUBI,SUBL,MUL ,MULI,MULL,DIV ,DIVI,DIVL,"
+  "DVU ,DVUI,DVUL,MOD ,MODI,MODL,MDU ,MDUI,MDUL,AND ,ANDI,ANDL,"
+  "OR  ,ORI ,ORL ,XOR ,XORI,XORL,SHL ,SHLI,SHLL,SHR ,SHRI,SHRL,"
+  "SRU ,SRUI,SRUL,EQ  ,EQF ,NE  ,NEF ,LT  ,LTU ,LTF ,GE  ,GEU ,GEF ,"
+  "BZ  ,BZF ,BNZ ,BNZF,BE  ,BEF ,BNE ,BNEF,BLT ,BLTU,BLTF,BGE ,BGEU,BGEF,"
+  "CID ,CUD ,CDI ,CDU ,"
+  "CLI ,STI ,RTI ,BIN ,BOUT,NOP ,SSP ,PSHA,PSHI,PSHF,PSHB,POPB,POPF,POPA,"
+  "IVEC,PDIR,SPAG,TIME,LVAD,TRAP,LUSP,SUSP,LCL ,LCA ,PSHC,POPC,MSIZ,"
+  "PSHG,POPG,NET1,NET2,NET3,NET4,NET5,NET6,NET7,NET8,NET9,"
+  "POW ,ATN2,FABS,ATAN,LOG ,LOGT,EXP ,FLOR,CEIL,HYPO,SIN ,COS ,TAN ,ASIN,"
+  "ACOS,SINH,COSH,TANH,SQRT,FMOD,"
+  "IDLE,LAC ,LBC ,";
+#endif
 
 char *cmd;       // command name
 
@@ -132,6 +186,88 @@ uint wlook(uint v)
   return 0;
 }
 
+// record a profile sample: {n | 1<<31 if user, page directory, pc, return addresses} with n counting the pcs.
+// idle samples are only counted, a final {0, count} records them.  return addresses are a best guess, words up the stack that point just past a JSR or JSRA.  only pages
+// with cached translations are looked at.
+void sample(uint pc, uint sp)
+{
+  uint *s, n, v, w, p, t, end;
+
+  if (sn + NSTACK + 4 > SBUF_SZ) { write(sfd, sbuf, sn * 4); sn = 0; }
+  s = sbuf + sn;
+  s[1] = paging ? pdir - mem : 0;
+  s[2] = pc;
+  n = 1;
+  end = user ? sp + NSCAN*4 : (sp + 4095) & -4096; // a kernel stack is one page
+  for (v = sp & -4; v >= sp && v < end && n < NSTACK; v += 4) {
+    if (!(p = tr[v >> 12])) break;
+    w = *(uint *)((v ^ p) & -4);
+    if ((w & 3) || w < 4 || !(t = tr[(w - 4) >> 12])) continue;
+    t = *(uint *)(((w - 4) ^ t) & -4);
+    if ((uchar)t == JSR || (uchar)t == JSRA) s[2 + n++] = w;
+  }
+  s[0] = n | (user ? 0x80000000 : 0);
+  sn += n + 2;
+}
+
+#ifdef HIST
+// find or add the block starting at pc, 0 once the table is three quarters full
+struct hblock *hlook(uint pc, uint pd)
+{
+  uint h; struct hblock *b;
+  for (h = (pc >> 2) * 2654435761 ^ pd;; h++) {
+    b = &hblk[h & (NHBLK-1)];
+    if (b->pc == pc && b->pdir == pd && b->n) return b;
+    if (!b->n) break;
+  }
+  if (hblks >= NHBLK/4*3) return 0;
+  hblks++;
+  b->pc = pc; b->pdir = pd;
+  return b;
+}
+
+// -p: count an instruction about to execute.  a block starts wherever the last instruction left the sequence
+void histo(uint pc, uint ir)
+{
+  ir &= 0xff;
+  if (hcond) { if (pc != hpc) { htaken[hcond]++; if (hb) hb->taken++; } hcond = 0; }
+  if (pc != hpc || hend) {
+    if (hb = hlook(pc, (paging ? pdir - mem : 0) | user)) hb->n++; else hlost++;
+    hi = 0;
+  }
+  if (hb) { hb->ins += 1; if (++hi > hb->len) hb->len = hi; }
+  hop[ir]++;
+  hpc = pc + 4;
+  hend = ir <= JSRA || ir == RTI || ir == TRAP || ir == SSP || ir == PDIR || ir == SPAG || ir == IDLE;
+  if (ir >= BZ && ir <= BGEF) hend = hcond = ir;
+}
+
+void hreport()
+{
+  uint i, j, t, n, order[256]; double tot; struct hblock *b, *m;
+
+  for (tot = 0, n = i = 0; i < 256; i++) if (hop[i]) { tot += hop[i]; order[n++] = i; }
+  if (!n) return;
+  for (i = 1; i < n; i++) for (j = i; j && hop[order[j]] > hop[order[j-1]]; j--) { t = order[j]; order[j] = order[j-1]; order[j-1] = t; }
+  dprintf(2,"\nopcode       count      %%  taken%%\n");
+  for (i = 0; i < n; i++) {
+    t = order[i];
+    if (t >= BZ && t <= BGEF) dprintf(2,"%.4s  %12u  %5.1f  %5.1f\n", &ops[t*5], hop[t], hop[t] * 100.0 / tot, htaken[t] * 100.0 / hop[t]);
+    else dprintf(2,"%.4s  %12u  %5.1f\n", &ops[t*5], hop[t], hop[t] * 100.0 / tot);
+  }
+
+  dprintf(2,"\n%u basic blocks (%u entries not counted), hottest by instructions:\n", hblks, hlost);
+  dprintf(2,"      pc      pdir       entries  length      %%  taken%%\n");
+  for (i = 0; i < NHTOP; i++) { // pick out the hottest, clearing each as it is reported
+    for (m = 0, b = hblk; b < &hblk[NHBLK]; b++) if (b->ins > 0 && (!m || b->ins > m->ins)) m = b;
+    if (!m) break;
+    dprintf(2,"%08x  %08x%s  %12u  %6u  %5.1f  %5.1f\n", m->pc, m->pdir & -2, (m->pdir & 1) ? "u" : "k", m->n, m->len,
+      m->ins * 100.0 / tot, m->taken * 100.0 / m->n);
+    m->ins = 0;
+  }
+}
+#endif
+
 void cpu(uint pc, uint sp)
 {
   uint a, b, c, ssp, usp, t, p, v, u, delta, cycle, xcycle, timer, timeout, fpc, tpc, xsp, tsp, fsp;
@@ -168,6 +304,7 @@ next:
       if ((uint)xpc > xcycle) {
         cycle += delta;
         xcycle += delta * 4;
+        if (sbuf && (scount += delta) >= sint) { scount = 0; sample((uint)xpc - tpc, xsp - tsp); }
         if (iena || !(ipend & FKEYBD)) { // XXX dont do this, use a small queue instead
           pfd.fd = 0;
           pfd.events = POLLIN;
@@ -189,6 +326,9 @@ next:
         }
       }
     }
+#ifdef HIST
+    if (hist) histo((uint)xpc - tpc, *xpc);
+#endif
     switch ((uchar)(ir = *xpc++)) {    
     case HALT: if (user || verbose) dprintf(2,"halt(%d) cycle = %u\n", a, cycle + (int)((uint)xpc - xcycle)/4); return; // XXX should be supervisor!
     case IDLE: if (user) { trap = FPRIV; break; }
@@ -204,6 +344,7 @@ next:
           goto interrupt;
         }
         cycle += delta;
+        if (sbuf && (scount += delta) >= sint) { scount = 0; sidle++; }
         if (timeout) {
           timer += delta;
           if (timer >= timeout) { // XXX  // any interrupt actually!
@@ -427,8 +568,10 @@ next:
                if (!(p = tr[(v = xsp - tsp + (ir>>8)) >> 12]) && !(p = rlook(v))) break; c = *(uint *) ((v ^ p) & -4);
                if (fsp || (v ^ (xsp - tsp)) & -4096) continue; goto fixsp;
 
-    case LBA:  b = a; continue;  // XXX need LAB, LAC to improve k.c  // or maybe a = a * imm + b ?  or b = b * imm + a ?
+    case LBA:  b = a; continue;  // XXX need LAB to improve k.c  // or maybe a = a * imm + b ?  or b = b * imm + a ?
     case LCA:  c = a; continue;
+    case LAC:  a = c; continue;
+    case LBC:  b = c; continue;
     case LBAD: g = f; continue;
 
     // store a local
@@ -693,7 +836,7 @@ fatal:
 
 usage()
 { 
-  dprintf(2,"%s : usage: %s [-v] [-m memsize] [-f filesys] file\n", cmd, cmd);
+  dprintf(2,"%s : usage: %s [-v] [-p] [-m memsize] [-f filesys] [-s samples [-i cycles]] file\n", cmd, cmd);
   exit(-1);
 }
 
@@ -701,19 +844,25 @@ int main(int argc, char *argv[])
 {
   int i, f;
   struct { uint magic, bss, entry, flags; } hdr;
-  char *file, *fs;
+  char *file, *fs, *prof;
   struct stat st;
   
   cmd = *argv++;
   if (argc < 2) usage();
   file = *argv;
   memsz = MEM_SZ;
-  fs = 0;
+  fs = prof = 0;
+  sint = 16384;
   while (--argc && *file == '-') {
     switch(file[1]) {
     case 'v': verbose = 1; break;
+#ifdef HIST
+    case 'p': hist = 1; break;
+#endif
     case 'm': memsz = atoi(*++argv) * (1024 * 1024); argc--; break;
     case 'f': fs = *++argv; argc--; break;
+    case 's': prof = *++argv; argc--; break;
+    case 'i': sint = atoi(*++argv); argc--; break;
     default: usage();
     }
     file = *++argv;
@@ -726,6 +875,7 @@ int main(int argc, char *argv[])
     if (verbose) dprintf(2,"%s : loading ram file system %s\n", cmd, fs);
     if ((f = open(fs, O_RDONLY)) < 0) { dprintf(2,"%s : couldn't open file system %s\n", cmd, fs); return -1; }
     if (fstat(f, &st)) { dprintf(2,"%s : couldn't stat file system %s\n", cmd, fs); return -1; }
+    if (st.st_size > FS_SZ) { dprintf(2,"%s : file system %s larger than %d\n", cmd, fs, FS_SZ); return -1; }
     if ((i = read(f, (void*)(mem + memsz - FS_SZ), st.st_size)) != st.st_size) { dprintf(2,"%s : failed to read filesystem size %d returned %d\n", cmd, st.st_size, i); return -1; }
     close(f);
   }
@@ -749,8 +899,28 @@ int main(int argc, char *argv[])
   tr = trk;
   tw = twk;
 
+  if (prof) {
+    if ((sfd = open(prof, O_WRONLY | O_CREAT | O_TRUNC)) < 0) { dprintf(2,"%s : couldn't open %s\n", cmd, prof); return -1; }
+    sbuf = (uint *) new(SBUF_SZ * sizeof(uint));
+    sbuf[0] = 0x666f7270; // "prof"
+    sbuf[1] = sint;
+    sn = 2;
+  }
+
+#ifdef HIST
+  if (hist) hblk = (struct hblock *) new(NHBLK * sizeof(struct hblock));
+#endif
+
   if (verbose) dprintf(2,"%s : emulating %s\n", cmd, file);
   cpu(hdr.entry, memsz - FS_SZ);
+#ifdef HIST
+  if (hist) hreport();
+#endif
+  if (prof) {
+    sbuf[sn++] = 0; sbuf[sn++] = sidle;
+    write(sfd, sbuf, sn * 4);
+    close(sfd);
+  }
   return 0;
 }
 
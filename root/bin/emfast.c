@@ -427,8 +427,10 @@ next:
                if (!(p = tr[(v = xsp - tsp + (ir>>8)) >> 12]) && !(p = rlook(v))) break; c = *(uint *) ((v ^ p) & -4);
                if (fsp || (v ^ (xsp - tsp)) & -4096) continue; goto fixsp;
 
-    case LBA:  b = a; continue;  // XXX need LAB, LAC to improve k.c  // or maybe a = a * imm + b ?  or b = b * imm + a ?
+    case LBA:  b = a; continue;  // XXX need LAB to improve k.c  // or maybe a = a * imm + b ?  or b = b * imm + a ?
     case LCA:  c = a; continue;
+    case LAC:  a = c; continue;
+    case LBC:  b = c; continue;
     case LBAD: g = f; continue;
 
     // store a local
@@ -726,6 +728,7 @@ int main(int argc, char *argv[])
     if (verbose) dprintf(2,"%s : loading ram file system %s\n", cmd, fs);
     if ((f = open(fs, O_RDONLY)) < 0) { dprintf(2,"%s : couldn't open file system %s\n", cmd, fs); return -1; }
     if (fstat(f, &st)) { dprintf(2,"%s : couldn't stat file system %s\n", cmd, fs); return -1; }
+    if (st.st_size > FS_SZ) { dprintf(2,"%s : file system %s larger than %d\n", cmd, fs, FS_SZ); return -1; }
     if ((i = read(f, (void*)(mem + memsz - FS_SZ), st.st_size)) != st.st_size) { dprintf(2,"%s : failed to read filesystem size %d returned %d\n", cmd, st.st_size, i); return -1; }
     close(f);
   }
@@ -161,6 +161,8 @@ int cpu(uint pc, int argc, char **argv)
     case LCL:  c = *(uint *)(sp + (ir>>8)); continue;
     case LBA:  b = a; continue;
     case LCA:  c = a; continue;
+    case LAC:  a = c; continue;
+    case LBC:  b = c; continue;
     case LBAD: g = f; continue;
 
     // store a local
@@ -1,20 +1,50 @@
 // fsd -- file server daemon
+//
+// Usage:  fsd [-v] [-d] [-p port]
+//
+// Description:
+//   fsd serves files to the kernel's remote file system (paths beginning with rfs/).
+//   Each request is five ints {op, id, fh, off, n} followed by n bytes of path (M_OPEN)
+//   or data (M_WRITE).  Each reply is three ints {id, r, n} followed by n bytes of data
+//   (M_READ) or attributes (M_OPEN, M_FSTAT).  Requests are answered in order, so the
+//   client may keep several in flight.  Offsets are explicit, there is no seek.
+//
+//   One process serves every client from a poll() loop, each client with its own table
+//   of file handles.  Write payloads go to the file as they arrive and every reply leaves
+//   in a single write with its data gathered behind the header.
 
 #include <u.h>
 #include <libc.h>
 #include <net.h>
 
-enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_SEEK, M_FSTAT, M_SYNC };
+enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_FSTAT, M_SYNC };
 
 // M_LINK, M_UNLINK, M_MKDIR
 
+enum {
+  NCLIENT = 8,        // connections
+  NFH     = 32,       // file handles per client
+  IBUF    = 8192,     // request buffer per client, holds a header and a path
+  OBUF    = 64*1024,  // reply buffer, bounds a single read
+};
+
+struct rattr { struct stat st; uint mtime; };
+
+struct client {
+  int sd;             // -1 if free
+  int fh[NFH];        // file descriptors, -1 if free
+  int h[5];           // request being received
+  int need;           // M_WRITE payload still to come
+  int r;              // M_WRITE result so far
+  int pi;             // poll slot
+  int n;              // bytes buffered
+  char in[IBUF];
+} client[NCLIENT];
+
+char out[OBUF]; // reply header followed by its data
+
 int debug;
 int verbose;
-int sync; // XXX
-
-int sd = -1;
-int fd = -1;
-char *s;
 
 void fatal(char *s)
 {
@@ -22,115 +52,130 @@ void fatal(char *s)
   exit(-1);
 }
 
-void tx(void *p, uint n)
+void drop(struct client *c)
 {
-  int r;
-  while (n) {
-    if ((r = write(sd, p, n)) <= 0) fatal("tx()");
-    n -= r;
-    p += r; 
-  }
+  int i;
+  if (verbose) printf("Connection closed\n");
+  for (i = 0; i < NFH; i++) if (c->fh[i] >= 0) { close(c->fh[i]); c->fh[i] = -1; }
+  close(c->sd);
+  c->sd = -1;
 }
 
-void rx(void *p, int n)
+// send the header and the n bytes of data already placed behind it in one write
+int reply(struct client *c, int r, int n)
 {
-  int r;
-  while (n) {
-    if ((r = read(sd, p, n)) <= 0) { if (verbose) printf("Connection closed\n"); exit(0); }
-    n -= r;
-    p += r; 
-  }
+  int *h = (int *)out; char *p = out;
+  h[0] = c->h[1]; h[1] = r; h[2] = n;
+  for (n += 12; n > 0; n -= r, p += r)
+    if ((r = write(c->sd, p, n)) <= 0) { drop(c); return -1; }
+  return 0;
+}
+
+// open flags arrive in this system's encoding
+int oflags(int f)
+{
+  return (f & 3) | ((f & 0x100) ? O_CREAT : 0) | ((f & 0x200) ? O_TRUNC : 0);
+}
+
+int attr(int fd, struct rattr *a)
+{
+  memset(a, 0, sizeof(struct rattr));
+#ifdef LINUX
+  a->mtime = xmtime(fd); // the guest keeps no modification times
+#endif
+  return fstat(fd, &a->st);
 }
 
-ssize(int n)
+// carry out a request whose header (and path) has arrived
+int request(struct client *c, char *path)
 {
-  static int sn = 0;
-  n = (n + 4095) & -4096;
-  if (n > sn) {
-    if (!s) s = sbrk(n); else sbrk(n - sn);
-    sn = n;
-//    if (s) free(s);
-//    s = malloc(n);
-//    if (!s) fatal("ssize() malloc");
+  int *h = c->h, i, fd, r, n;
+
+  fd = -1;
+  if (h[0] != M_OPEN && (uint)h[2] < NFH) fd = c->fh[h[2]];
+  if (h[0] == M_WRITE) { // the payload is written as it arrives
+    c->need = h[4];
+    c->r = (fd >= 0 && lseek(fd, h[3], SEEK_SET) >= 0) ? 0 : -1;
+    return c->need ? 0 : reply(c, c->r, 0);
+  }
+  if (h[0] != M_OPEN && fd < 0) {
+    if (debug) printf("bad handle %d\n", h[2]);
+    return reply(c, -1, 0);
   }
+  switch (h[0]) {
+  case M_OPEN:
+    for (i = 0; i < NFH && c->fh[i] >= 0; i++) ;
+    fd = (i < NFH) ? open(path, oflags(h[3])) : -1; // XXX third arg?
+    if (debug) printf("%d = open(%s, %d)\n", fd, path, h[3]);
+    if (fd >= 0 && attr(fd, (struct rattr *)(out + 12))) { close(fd); fd = -1; }
+    if (fd < 0) return reply(c, -1, 0);
+    c->fh[i] = fd;
+    return reply(c, i, sizeof(struct rattr));
+  case M_CLOSE:
+    r = close(fd);
+    if (debug) printf("%d = close(%d)\n", r, fd);
+    c->fh[h[2]] = -1;
+    return reply(c, r, 0);
+  case M_READ:
+    if ((n = h[4]) > OBUF - 12) n = OBUF - 12;
+    lseek(fd, h[3], SEEK_SET);
+    r = read(fd, out + 12, n);
+    if (debug) printf("%d = read(%d, s, %d) @ %d\n", r, fd, n, h[3]);
+    return reply(c, r, r > 0 ? r : 0);
+  case M_FSTAT:
+    r = attr(fd, (struct rattr *)(out + 12));
+    if (debug) printf("%d = fstat(%d, sp)\n", r, fd);
+    return reply(c, r, r ? 0 : sizeof(struct rattr));
+  case M_SYNC:
+//    r = fsync(fd);  // XXX does win32 have this?
+    if (debug) printf("fsync(%d)\n", fd);
+    return reply(c, 0, 0);
+  }
+  if (verbose) printf("bad message %d\n", h[0]);
+  drop(c);
+  return -1;
 }
 
-void rxmsgs(void)
+// work through everything buffered for a client
+void serve(struct client *c)
 {
-  int h[3], n, r; struct stat hs;
-  
-  for (;;) {
-    rx(&n,4);
-    switch (n) {
-    case M_OPEN:
-      if (fd >= 0) fatal("open");
-      rx(h,12); ssize(h[2]);
-      rx(s,h[2]);
-//      sync = (h[0] & O_SYNC);
-      sync = 0;
-//      h[1] = S_IRWXU; // XXX
-//      fd = open(s, h[0] | O_BINARY, h[1]); // XXX third arg?
-      fd = open(s, h[0]); // XXX
-      if (debug) printf("%d = open(%s, %d, %d)\n",fd,s,h[0],h[1]);
-      r = (fd >= 0) ? 0 : -1;
-      tx(&r,4);
-      break;
-    case M_CLOSE:
-      if (fd < 0) fatal("close");
-      close(fd);
-      if (debug) printf("close(%d)\n",fd);
-      fd = -1;
-      break;
-    case M_READ:
-      if (fd >= 0) {
-        rx(&n,4); ssize(n);
-        r = read(fd, s, n);
-        if (debug) printf("%d = read(%d, s, %d)\n", r, fd, n);
-        tx(&r,4);
-        if ((uint)r <= n) tx(s, r);
-      } else fatal("read");
-      break;
-    case M_WRITE:
-      if (fd < 0) fatal("write");
-      rx(&n,4); ssize(n);
-      if (n > 0) rx(s, n);
-      r = write(fd, s, n);
-      if (debug) printf("%d = write(%d, s, %d)\n", r, fd, n);
-      if (sync) tx(&r,4);
-      break;
-    case M_SEEK:
-      if (fd < 0) fatal("lseek");
-      rx(h,8);
-      r = lseek(fd, h[0], h[1]);
-      if (debug) printf("%d = lseek(%d, %d, %d)\n", r, fd, h[0], h[1]);
-      tx(&r,4);
-      break;
-    case M_FSTAT:
-      if (fd >= 0) {
-        r = fstat(fd, &hs);
-        if (debug) printf("%d = fstat(%d, sp)\n", r, fd);
-        tx(&r,4);
-        if (r == 0) {
-          tx(&hs, sizeof(hs));
-        }
-      } else fatal("fstat");
-      break;
-    case M_SYNC:
-      if (fd < 0) fatal("fsync");
-//      r = fsync(fd);  // XXX does win32 have this?
-      if (debug) printf("%d = fsync(%d)\n", r, fd);
-      tx(&r,4);
-      break;
-    default:
-      fatal("bad message");
+  int i, m, fd; char *p = c->in, *e = c->in + c->n;
+
+  while (c->sd >= 0) {
+    m = e - p;
+    if (c->need) { // M_WRITE payload
+      if (!m) break;
+      if (m > c->need) m = c->need;
+      if (c->r >= 0 && (fd = c->fh[c->h[2]]) >= 0 && write(fd, p, m) == m) c->r += m; else c->r = -1;
+      if (debug) printf("%d = write(%d, s, %d)\n", c->r, c->h[2], m);
+      p += m;
+      if (!(c->need -= m)) reply(c, c->r, 0);
+      continue;
+    }
+    if (m < 20) break;
+    memcpy(c->h, p, 20);
+    if (c->h[0] == M_OPEN) {
+      if ((uint)c->h[4] - 1 >= IBUF - 20) { if (verbose) printf("bad path length\n"); drop(c); return; }
+      if (m < 20 + c->h[4]) break;
+      p[20 + c->h[4] - 1] = 0;
+      p += 20 + c->h[4];
+      request(c, p - c->h[4]);
+    } else {
+      p += 20;
+      request(c, 0);
     }
   }
+  if (c->sd < 0) return;
+  for (i = 0; p + i < e; i++) c->in[i] = p[i];
+  c->n = i;
 }
 
 int main(int argc, char *argv[])
 {
-  int i, ld;
+  int i, n, ld, sd, nc;
+  struct client *c;
   struct sockaddr_in addr;
+  static struct pollfd pfd[NCLIENT+1];
   int port = 5003;
 
   for (i=1; i<argc; i++) {
@@ -139,7 +184,11 @@ int main(int argc, char *argv[])
     if (!strcmp(argv[i],"-p") && i+1 < argc) port = atoi(argv[++i]); else
     fatal("usage: fsrv [-v] [-d] [-p port]");
   }
-  
+
+  memset(client, 0, sizeof(client)); // fault the pages in before the sockets write to them
+  memset(out, 0, sizeof(out));
+  for (c = client; c < &client[NCLIENT]; c++) c->sd = -1;
+
   if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0) fatal("socket()");
 //    i = 1; setsockopt(ld, SOL_SOCKET, SO_REUSEADDR, (const char *) &i, sizeof(i));
   memset(&addr, 0, sizeof(addr));
@@ -148,19 +197,35 @@ int main(int argc, char *argv[])
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
   if (bind(ld, (struct sockaddr *) &addr, sizeof(addr)) < 0) fatal("bind()");
-  if (listen(ld, 1) < 0) fatal("listen()");
+  if (listen(ld, NCLIENT) < 0) fatal("listen()");
   if (verbose) printf("Listening on port %d...\n", port) ;
 
   for (;;) {
-    if ((sd = accept(ld, 0, 0)) < 0) fatal("accept()");
-    if (verbose) printf("Connection accepted\n");
+    n = nc = 0;
+    for (c = client; c < &client[NCLIENT]; c++) {
+      if (c->sd < 0) continue;
+      nc++;
+      pfd[c->pi = n].fd = c->sd; pfd[n++].events = POLLIN;
+    }
+    if (nc < NCLIENT) { pfd[n].fd = ld; pfd[n++].events = POLLIN; } // leave new clients queued while full
+
+    if (poll(pfd, n, -1) < 0) fatal("poll()");
+
+    for (c = client; c < &client[NCLIENT]; c++) {
+      if (c->sd < 0 || !pfd[c->pi].revents) continue;
+      if ((i = read(c->sd, c->in + c->n, IBUF - c->n)) <= 0) { drop(c); continue; }
+      c->n += i;
+      serve(c);
+    }
+
+    if (nc < NCLIENT && pfd[n-1].revents) {
+      if ((sd = accept(ld, 0, 0)) < 0) fatal("accept()");
+      if (verbose) printf("Connection accepted\n");
 //      i = 1; setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (const char *) &i, sizeof(i));
-    if ((i = fork()) < 0) fatal("fork()");
-    if (!i) {
-      close(0);
-      close(ld);
-      rxmsgs();
+      for (c = client; c->sd >= 0; c++) ;
+      c->sd = sd;
+      c->n = c->need = 0;
+      for (i = 0; i < NFH; i++) c->fh[i] = -1;
     }
-    close(sd);
   }
 }
@@ -7,6 +7,15 @@
 //   no authentication or security of any sort.  Useful for single machine
 //   host/guest file transfers.
 //
+//   A single process serves all sessions, multiplexing the control and data
+//   connections with poll().  Transfers move in chunks of up to XBUF bytes so
+//   one large file doesn't hold up the other sessions: each pass of the loop
+//   sends one chunk for every RETR, and STOR collects what the socket has into
+//   a chunk that is written to the file once full.  Nothing overlaps; reads and
+//   writes are synchronous, and since the guest's poll() has no POLLOUT the
+//   loop doesn't sleep while a RETR is running but is paced by its sends.
+//   REST sets the offset for the next RETR or STOR.
+//
 //   The following options are supported:
 //
 //   -v   Verbose output
@@ -21,55 +30,66 @@
 #include <dir.h>
 #include <ctype.h>
 
-enum { MAX_PATH = 512 }; // XXX
+enum {
+  MAX_PATH = 512, // XXX
+  NSESS = 4,      // sessions, each may hold a control, data and file descriptor
+  LINE  = 512,    // command line buffer
+  XBUF  = 32*1024 // transfer chunk
+};
+
+enum { IDLE, RETR, STOR }; // transfer state
+
+struct sess {
+  int cd;                   // control socket, -1 if free
+  char cwd[MAX_PATH];       // working directory
+  char line[LINE]; int len; // partial command line
+  char rnfr[MAX_PATH];      // rename from
+  struct sockaddr_in xaddr; // transfer address
+  int rest;                 // restart offset for the next transfer
+  int xfer, xd, file;       // transfer in progress
+  int n;                    // bytes in the chunk
+  char *buf;
+  int pc, px;               // poll slots for control and data sockets
+} sess[NSESS];
 
-struct sockaddr_in xaddr; // transfer address
-int xaddrlen;
-char xbuf[256*1024]; // transfer buffer
-int cd; // control socket
 int getonly, verbose;
 char cmd[6];
 
-int command(char *arg)
+void reply(struct sess *s, char *r)
 {
-  char buf[501];
-  int len, i, j;
-
-  for (len = 0;;) {
-    if (len >= sizeof(buf) - 1) return 0;
-    if ((i = read(cd, buf + len, sizeof(buf)-1 - len)) <= 0) return 0;
-    buf[len += i] = 0;
-    if (strchr(buf, '\r')) break;
-  }
-
-  for (i=0; i < sizeof(cmd)-1; i++) {
-    if (!isalpha(buf[i])) break;
-    cmd[i] = toupper(buf[i]);
-  }
-  cmd[i] = 0;
+  char buf[MAX_PATH+20];
+  if (verbose) dprintf(2,"  %s\n",r);
+  sprintf(buf, "%s\r\n", r);
+  write(s->cd, buf, strlen(buf));
+}
 
-  j = 0;
-  if (buf[i++] == ' ') {
-    for (; j<500; j++) {
-      if (buf[i+j] < 32) break;
-      arg[j] = buf[i+j];
-    }
-  }
-  arg[j] = 0;
+// open the data connection
+int xopen(struct sess *s)
+{
+  int xd;
+  if ((xd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  if (connect(xd, (struct sockaddr *)&s->xaddr, sizeof(s->xaddr)) < 0) { close(xd); return -1; }
+  return xd;
+}
 
-  if (verbose) dprintf(2,"%s %s\n", cmd, arg);
-  return 1;
+// finish the transfer in progress
+void done(struct sess *s, char *r)
+{
+  close(s->xd);
+  close(s->file);
+  s->xfer = IDLE;
+  reply(s, r);
 }
 
-void reply(char *r)
+void drop(struct sess *s)
 {
-  char buf[MAX_PATH+20];
-  if (verbose) dprintf(2,"  %s\n",r);
-  sprintf(buf, "%s\r\n", r);
-  write(cd, buf, strlen(buf));
+  if (verbose) dprintf(2,"Closing control connection\n");
+  if (s->xfer) { close(s->xd); close(s->file); s->xfer = IDLE; }
+  close(s->cd);
+  s->cd = -1;
 }
 
-void nlst(char *name, int listlong, int usectl)
+void nlst(struct sess *s, char *name, int listlong, int usectl)
 {
   int xd, i;
   char buf[500], timestr[20];
@@ -79,20 +99,19 @@ void nlst(char *name, int listlong, int usectl)
 //  struct tm *tm;
 
   if (usectl)
-    xd = cd;
+    xd = s->cd;
   else {
-    reply("150 Opening connection");
-    if ((xd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(xd, (struct sockaddr *)&xaddr, xaddrlen) < 0)
-      { reply("550 connect() error"); return; }
+    reply(s, "150 Opening connection");
+    if ((xd = xopen(s)) < 0) { reply(s, "425 connect() error"); return; }
   }
 
   if (*name == 0) name = ".";
-  else if (*name == '-') { 
+  else if (*name == '-') {
     for (i=1; name[i]; i++) { if (name[i] == 'l') listlong = 1; }
     name = ".";
   }
 
-  if (!(d = opendir(name))) { reply("550 connect() error"); return; }
+  if (!(d = opendir(name))) { if (!usectl) close(xd); reply(s, "550 opendir() error"); return; }
   while (de = readdir(d)) {
     if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
     if (listlong) { // ls -lA
@@ -106,7 +125,7 @@ void nlst(char *name, int listlong, int usectl)
 
 //      sprintf(buf,"%c%s   1 root  root  %7u %s %s\r\n", (S_ISDIR(st.st_mode) ? 'd' : '-'), ((st.st_mode & S_IWUSR) ? "rw-rw-rw-" : "r--r--r--"), st.st_size, timestr, de->d_name);
       sprintf(buf,"%c%s   1 root  root  %7u %s %s\r\n", ((st.st_mode & S_IFMT) == S_IFDIR ? 'd' : '-'), "rw-rw-rw-", st.st_size, timestr, de->d_name);
-            
+
     } else { // ls
       sprintf(buf, "%s\r\n",de->d_name);
     }
@@ -117,82 +136,100 @@ void nlst(char *name, int listlong, int usectl)
 
   if (!usectl) {
     close(xd);
-    reply("226 Transfer Complete");
+    reply(s, "226 Transfer Complete");
   }
 }
 
-void retr(char *name)
+// start a RETR or STOR, the transfer itself is driven from the poll loop
+void xfer(struct sess *s, char *name, int dir)
 {
-  int file, xd, size; // XXX fix size < 0 nonsense logic
-
-  if ((file = open(name, O_RDONLY)) < 0) { reply("550 open() error"); return; }
+  int file, rest;
 
-  reply("150 Opening BINARY mode data connection");
-  if ((xd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(xd, (struct sockaddr *)&xaddr, xaddrlen) < 0)
-    { reply("550 connect() error"); return; }
-
-  for (size=1;size > 0;) {
-    if ((size = read(file, xbuf, sizeof(xbuf))) < 0) { reply("550 read() error"); break; }
-    if (write(xd, xbuf, size) < 0) {
-      if (verbose) dprintf(2,"send failed\n");
-      reply("426 Broken pipe") ;
-      size = -1;
-    }
+  rest = s->rest;
+  s->rest = 0;
+  if (!s->buf) {
+    if (!(s->buf = malloc(XBUF))) { reply(s, "451 out of memory"); return; }
+    memset(s->buf, 0, XBUF); // fault the pages in before the sockets write to them
   }
 
-  if (size >= 0) reply("226 Transfer Complete");   // XXX fix size < 0 nonsense logic
-  close(xd);
-  close(file);
+  if (dir == RETR) file = open(name, O_RDONLY);
+  else file = open(name, rest ? (O_WRONLY | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC)); // XXX third arg?
+  if (file < 0) { reply(s, "550 open() error"); return; }
+  if (rest && lseek(file, rest, SEEK_SET) != rest) { close(file); reply(s, "550 lseek() error"); return; }
+
+  reply(s, "150 Opening BINARY mode data connection");
+  if ((s->xd = xopen(s)) < 0) { close(file); reply(s, "425 connect() error"); return; }
+  s->file = file;
+  s->xfer = dir;
+  s->n = 0;
 }
 
-void stor(char *name)
+// send the next chunk of the file
+void retr(struct sess *s)
 {
-  int file, xd, size; // XXX fix size < 0 nonsense logic
+  int r;
 
-  if ((file = open(name, O_WRONLY | O_CREAT | O_TRUNC)) < 0) { reply("550 open() error"); return; } // XXX third arg?
-
-  reply("150 Opening BINARY mode data connection");
-  if ((xd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(xd, (struct sockaddr *)&xaddr, xaddrlen) < 0)
-    { reply("550 connect() error"); return; }
-
-  for (size=1;size >= 0;) {
-//    if ((size = read(xd, xbuf, sizeof(xbuf))) < 0) { if (verbose) dprintf(2,"read failed\n"); reply("550 read() error"); break; }
-    if ((size = read(xd, xbuf, 256)) < 0) { if (verbose) dprintf(2,"read failed\n"); reply("550 read() error"); break; } // XXX buffer sizes are all crapped up right now
-    if (size == 0) { reply("226 Transfer Complete"); break; }
-    if (write(file, xbuf, size) != size) { reply("550 write() error"); break; }
+  if ((r = read(s->file, s->buf, XBUF)) < 0) { done(s, "451 read() error"); return; }
+  if (!r) { done(s, "226 Transfer Complete"); return; }
+  if (write(s->xd, s->buf, r) != r) {
+    if (verbose) dprintf(2,"send failed\n");
+    done(s, "426 Broken pipe");
   }
+}
 
-  close(xd);
+// add what the socket has to the chunk, write it to the file once full
+void stor(struct sess *s)
+{
+  int r;
 
-  close(file);
+  if ((r = read(s->xd, s->buf + s->n, XBUF - s->n)) < 0) {
+    if (verbose) dprintf(2,"read failed\n");
+    done(s, "451 read() error");
+    return;
+  }
+  s->n += r;
+  if (!r || s->n == XBUF) {
+    if (s->n && write(s->file, s->buf, s->n) != s->n) { done(s, "452 write() error"); return; }
+    s->n = 0;
+  }
+  if (!r) done(s, "226 Transfer Complete");
 }
 
-void mdtm(char *name)
+void mdtm(struct sess *s, char *name)
 {
-  struct stat s;
+  struct stat st;
 //  struct tm *t;
   char buf[50];
 
-  if (stat(name, &s)) { reply("550 stat() error"); return; }
-  if ((s.st_mode & S_IFMT) != S_IFREG) { reply("550 not a plain file."); return; } // it's a directory
-//  t = localtime(&s.st_mtime); // or gmtime()
+  if (stat(name, &st)) { reply(s, "550 stat() error"); return; }
+  if ((st.st_mode & S_IFMT) != S_IFREG) { reply(s, "550 not a plain file."); return; } // it's a directory
+//  t = localtime(&st.st_mtime); // or gmtime()
 //  sprintf(buf, "213 %04d%02d%02d%02d%02d%02d", t->tm_year+1900, t->tm_mon+1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec);
   strcpy(buf, "213 20010101010101");
-  reply(buf);
+  reply(s, buf);
 }
 
-void siz(char *name)
+void siz(struct sess *s, char *name)
 {
-  struct stat s;
+  struct stat st;
   char buf[50];
 
-  if (stat(name, &s)) { reply("550 stat() error"); return; }
-  if ((s.st_mode & S_IFMT) != S_IFREG) { reply("550 not a plain file."); return; } // it's a directory
-  sprintf(buf, "213 %u",s.st_size);
-  reply(buf);
+  if (stat(name, &st)) { reply(s, "550 stat() error"); return; }
+  if ((st.st_mode & S_IFMT) != S_IFREG) { reply(s, "550 not a plain file."); return; } // it's a directory
+  sprintf(buf, "213 %u",st.st_size);
+  reply(s, buf);
+}
+
+void rest(struct sess *s, char *arg)
+{
+  char buf[50];
+  s->rest = 0;
+  while ('0' <= *arg && *arg <= '9') s->rest = s->rest * 10 + *arg++ - '0';
+  sprintf(buf, "350 Restarting at %u", s->rest);
+  reply(s, buf);
 }
 
-void port(char *arg)
+void port(struct sess *s, char *arg)
 {
   char *a; int h1,h2,h3,h4,p1,p2;
 //  sscanf(arg,"%d,%d,%d,%d,%d,%d",&h1,&h2,&h3,&h4,&p1,&p2); // XXX
@@ -203,11 +240,11 @@ void port(char *arg)
   while ('0' <= *arg && *arg <= '9') h4 = h4 * 10 + *arg++ - '0'; arg++;
   while ('0' <= *arg && *arg <= '9') p1 = p1 * 10 + *arg++ - '0'; arg++;
   while ('0' <= *arg && *arg <= '9') p2 = p2 * 10 + *arg++ - '0'; arg++;
-  
-  a = (char *) &xaddr.sin_addr; a[0] = h1; a[1] = h2; a[2] = h3; a[3] = h4;
-  a = (char *) &xaddr.sin_port; a[0] = p1; a[1] = p2;
-  if (verbose) dprintf(2,"PORT(%d,%d)\n",xaddr.sin_addr.s_addr,xaddr.sin_port);
-  reply("200 PORT command successful");
+
+  a = (char *) &s->xaddr.sin_addr; a[0] = h1; a[1] = h2; a[2] = h3; a[3] = h4;
+  a = (char *) &s->xaddr.sin_port; a[0] = p1; a[1] = p2;
+  if (verbose) dprintf(2,"PORT(%d,%d)\n",s->xaddr.sin_addr.s_addr,s->xaddr.sin_port);
+  reply(s, "200 PORT command successful");
 }
 
 int mv(char *from, char *to)
@@ -217,77 +254,121 @@ int mv(char *from, char *to)
   return 0;
 }
 
-void handler()
+// split a command line into cmd and arg
+void parse(char *buf, char *arg)
 {
-  char arg[MAX_PATH+10], buf[MAX_PATH+10];
+  int i, j;
 
-  chdir("/");
+  for (i=0; i < sizeof(cmd)-1; i++) {
+    if (!isalpha(buf[i])) break;
+    cmd[i] = toupper(buf[i]);
+  }
+  cmd[i] = 0;
 
-  // get default data address for transfer socket
-  xaddrlen = sizeof(xaddr);
-//  if (getsockname(cd, (struct sockaddr *)&xaddr, &xaddrlen) < 0) {
-//    if (verbose) dprintf(2,"getsockname() failed\n");
-//    reply("500 getsockname failed");
-//    goto end;
-//  }
-//  if (verbose) dprintf(2,"getsockname(%d,%d)\n",xaddr.sin_addr.s_addr,xaddr.sin_port);
-  xaddr.sin_family = AF_INET;
-
-  reply("220 ftpd ready");
-  while (command(arg)) {
-    if (!strncmp(cmd, "USER", 4)) reply("331 pretend login accepted");
-    else if (!strncmp(cmd, "PASS", 4)) reply("230 fake user logged in");
-    else if (!strncmp(cmd, "SYST", 4)) reply("215 ftpd");
-    else if (!strncmp(cmd, "PASV", 4)) reply("550 Permission denied");
-    else if (!strncmp(cmd, "XPWD", 4) || !strncmp(cmd, "PWD")) { // print working directory
-      getcwd(arg, sizeof(arg));
-      sprintf(buf,"257 \"%s\"", arg);
-      reply(buf);
-    }
-    else if (!strncmp(cmd, "NLST", 4)) nlst(arg, 0, 0); // request directory, names only
-    else if (!strncmp(cmd, "LIST", 4)) nlst(arg, 1, 0); // request directory, long version
-    else if (!strncmp(cmd, "STAT", 4)) nlst(arg, 1, 1); // like LIST, but use control connection
-    else if (!strncmp(cmd, "DELE", 4)) {
-      if (unlink(arg)) reply("550 unlink() error");
-      else reply("250 DELE command successful.");
-    }
-    else if (!strncmp(cmd, "RMD", 4) || !strncmp(cmd, "XRMD", 4)) {  // XXX for now
-//      if (getonly) reply("550 Permission denied");
-//      else if (rmdir(arg)) reply("550 rmdir() error");
-//      else reply("250 RMD command successful");
-      reply("550 Permission denied");
-    }
-    else if (!strncmp(cmd, "MKD", 4) || !strncmp(cmd, "XMKD", 4)) {
-      if (getonly) reply("550 Permission denied");
-      else if (mkdir(arg)) reply("550 mkdir() error");
-      else reply("257 Directory created");
-    }
-    else if (!strncmp(cmd, "RNFR", 4)) { // rename from
-      strcpy(buf, arg);
-      reply("350 File Exists");
-    }
-    else if (!strncmp(cmd, "RNTO", 4)) { // rename to, must be immediately preceeded by RNFR
-      if (getonly) reply("550 Permission denied");
-      else if (mv(buf, arg)) reply("550 rename() error");
-      else reply("250 RNTO command successful");
-    }
-    else if (!strncmp(cmd, "ABOR", 4)) reply("226 Aborted");
-    else if (!strncmp(cmd, "SIZE", 4)) siz(arg);
-    else if (!strncmp(cmd, "MDTM", 4)) mdtm(arg);
-    else if (!strncmp(cmd, "CWD", 4)) { // change working directory
-      if (chdir(arg)) reply("550 Could not change directory");
-      else reply("250 CWD command successful");
+  j = 0;
+  if (buf[i++] == ' ') {
+    for (; j<500; j++) {
+      if (buf[i+j] < 32) break;
+      arg[j] = buf[i+j];
     }
-    else if (!strncmp(cmd, "TYPE", 4)) reply("200 Type set to I"); // accept file TYPE commands, but ignore
-    else if (!strncmp(cmd, "NOOP", 4)) reply("200 OK");
-    else if (!strncmp(cmd, "PORT", 4)) port(arg); // set the TCP/IP address for transfers
-    else if (!strncmp(cmd, "RETR", 4)) retr(arg); // retrieve File and send it
-    else if (!strncmp(cmd, "STOR", 4)) { if (getonly) reply("553 Permission denied"); else stor(arg); } // store the file
-    else if (!strncmp(cmd, "QUIT", 4)) { reply("221 goodbye"); break; }
-    else reply("500 command not implemented");
   }
-  if (verbose) dprintf(2,"Closing control connection\n");
-  close(cd);
+  arg[j] = 0;
+
+  if (verbose) dprintf(2,"%s %s\n", cmd, arg);
+}
+
+void handler(struct sess *s, char *line)
+{
+  char arg[MAX_PATH+10], buf[MAX_PATH+10];
+
+  parse(line, arg);
+  chdir(s->cwd);
+
+  if (s->xfer && strncmp(cmd, "ABOR", 4) && strncmp(cmd, "QUIT", 4) && strncmp(cmd, "NOOP", 4)) reply(s, "425 Transfer in progress");
+  else if (!strncmp(cmd, "USER", 4)) reply(s, "331 pretend login accepted");
+  else if (!strncmp(cmd, "PASS", 4)) reply(s, "230 fake user logged in");
+  else if (!strncmp(cmd, "SYST", 4)) reply(s, "215 ftpd");
+  else if (!strncmp(cmd, "FEAT", 4)) reply(s, "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n211 End");
+  else if (!strncmp(cmd, "PASV", 4)) reply(s, "550 Permission denied");
+  else if (!strncmp(cmd, "XPWD", 4) || !strncmp(cmd, "PWD")) { // print working directory
+    sprintf(buf,"257 \"%s\"", s->cwd);
+    reply(s, buf);
+  }
+  else if (!strncmp(cmd, "NLST", 4)) nlst(s, arg, 0, 0); // request directory, names only
+  else if (!strncmp(cmd, "LIST", 4)) nlst(s, arg, 1, 0); // request directory, long version
+  else if (!strncmp(cmd, "STAT", 4)) nlst(s, arg, 1, 1); // like LIST, but use control connection
+  else if (!strncmp(cmd, "DELE", 4)) {
+    if (unlink(arg)) reply(s, "550 unlink() error");
+    else reply(s, "250 DELE command successful.");
+  }
+  else if (!strncmp(cmd, "RMD", 4) || !strncmp(cmd, "XRMD", 4)) {  // XXX for now
+//    if (getonly) reply(s, "550 Permission denied");
+//    else if (rmdir(arg)) reply(s, "550 rmdir() error");
+//    else reply(s, "250 RMD command successful");
+    reply(s, "550 Permission denied");
+  }
+  else if (!strncmp(cmd, "MKD", 4) || !strncmp(cmd, "XMKD", 4)) {
+    if (getonly) reply(s, "550 Permission denied");
+    else if (mkdir(arg)) reply(s, "550 mkdir() error");
+    else reply(s, "257 Directory created");
+  }
+  else if (!strncmp(cmd, "RNFR", 4)) { // rename from
+    strcpy(s->rnfr, arg);
+    reply(s, "350 File Exists");
+  }
+  else if (!strncmp(cmd, "RNTO", 4)) { // rename to, must be immediately preceeded by RNFR
+    if (getonly) reply(s, "550 Permission denied");
+    else if (mv(s->rnfr, arg)) reply(s, "550 rename() error");
+    else reply(s, "250 RNTO command successful");
+  }
+  else if (!strncmp(cmd, "ABOR", 4)) {
+    if (s->xfer) done(s, "426 Transfer aborted");
+    reply(s, "226 Aborted");
+  }
+  else if (!strncmp(cmd, "SIZE", 4)) siz(s, arg);
+  else if (!strncmp(cmd, "MDTM", 4)) mdtm(s, arg);
+  else if (!strncmp(cmd, "REST", 4)) rest(s, arg);
+  else if (!strncmp(cmd, "CWD", 4)) { // change working directory
+    if (chdir(arg) || !getcwd(buf, sizeof(buf))) reply(s, "550 Could not change directory");
+    else { strcpy(s->cwd, buf); reply(s, "250 CWD command successful"); }
+  }
+  else if (!strncmp(cmd, "TYPE", 4)) reply(s, "200 Type set to I"); // accept file TYPE commands, but ignore
+  else if (!strncmp(cmd, "NOOP", 4)) reply(s, "200 OK");
+  else if (!strncmp(cmd, "PORT", 4)) port(s, arg); // set the TCP/IP address for transfers
+  else if (!strncmp(cmd, "RETR", 4)) xfer(s, arg, RETR); // retrieve File and send it
+  else if (!strncmp(cmd, "STOR", 4)) { if (getonly) reply(s, "553 Permission denied"); else xfer(s, arg, STOR); } // store the file
+  else if (!strncmp(cmd, "QUIT", 4)) { reply(s, "221 goodbye"); drop(s); }
+  else reply(s, "500 command not implemented");
+}
+
+// read from the control connection and run each complete command
+void command(struct sess *s)
+{
+  int i, n; char *p;
+
+  if ((i = read(s->cd, s->line + s->len, sizeof(s->line)-1 - s->len)) <= 0) { drop(s); return; }
+  s->len += i;
+  while (s->cd >= 0 && (p = memchr(s->line, '\n', s->len))) {
+    *p = 0;
+    n = p + 1 - s->line;
+    handler(s, s->line);
+    for (i = n; i < s->len; i++) s->line[i - n] = s->line[i];
+    s->len -= n;
+  }
+  if (s->len == sizeof(s->line)-1) { reply(s, "500 line too long"); s->len = 0; }
+}
+
+void session(int cd)
+{
+  struct sess *s;
+
+  for (s = sess; s->cd >= 0; s++) ;
+  s->cd = cd;
+  s->len = s->rest = 0;
+  s->xfer = IDLE;
+  strcpy(s->cwd, "/");
+  s->xaddr.sin_family = AF_INET;
+  reply(s, "220 ftpd ready");
 }
 
 void usage(void)
@@ -298,9 +379,11 @@ void usage(void)
 
 int main(int argc, char **argv)
 {
-  int ld, port = 21, i;
+  int ld, cd, port = 21, i, n, busy, nsess;
+  struct sess *s;
   static struct sockaddr_in addr;
-   
+  static struct pollfd pfd[2*NSESS+1];
+
   for (i=1; i<argc; i++) {
     if (!strcmp(argv[i],"-p")) { if (argc < i+2) usage(); port = atoi(argv[++i]); }
     else if (!strcmp(argv[i],"-g")) getonly = 1;
@@ -308,27 +391,44 @@ int main(int argc, char **argv)
     else usage();
   }
 
+  close(0);
   chdir("/");
+  memset(sess, 0, sizeof(sess)); // fault the pages in before the sockets write to them
+  for (s = sess; s < &sess[NSESS]; s++) s->cd = -1;
 
   if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0) { dprintf(2,"socket() failed\n"); return -1; }
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   addr.sin_port = htons(port);
-  
+
   if (bind(ld, (struct sockaddr *)&addr, sizeof(addr)) < 0) { dprintf(2,"bind() failed\n"); return -1; }
-  if (listen(ld, 1) < 0) { dprintf(2,"listen() failed\n"); return -1; }
+  if (listen(ld, NSESS) < 0) { dprintf(2,"listen() failed\n"); return -1; }
   if (verbose) dprintf(2,"ftpd ready to accept connections on port %d\n", port);
 
   for (;;) {
-    if ((cd = accept(ld, 0, 0)) < 0) { dprintf(2,"accept() failed\n"); return -1; }
-    if (verbose) dprintf(2,"accepted new ftp connection\n");
-    if ((i = fork()) < 0) { dprintf(2,"fork() failed\n"); return -1; }
-    if (!i) {
-      close(0);
-      close(ld);
-      handler();
-      return 0;
+    n = busy = nsess = 0;
+    for (s = sess; s < &sess[NSESS]; s++) {
+      if (s->cd < 0) continue;
+      nsess++;
+      pfd[s->pc = n].fd = s->cd; pfd[n++].events = POLLIN;
+      if (s->xfer == STOR) { pfd[s->px = n].fd = s->xd; pfd[n++].events = POLLIN; }
+      else if (s->xfer == RETR) busy = 1; // no POLLOUT to wait on, a RETR sends a chunk every pass
+    }
+    if (nsess < NSESS) { pfd[n].fd = ld; pfd[n++].events = POLLIN; } // leave pending connections queued while full
+
+    if (poll(pfd, n, busy ? 0 : -1) < 0) { dprintf(2,"poll() failed\n"); return -1; }
+
+    for (s = sess; s < &sess[NSESS]; s++) {
+      if (s->cd < 0) continue;
+      if (s->xfer == RETR) retr(s);
+      else if (s->xfer == STOR && pfd[s->px].revents) stor(s);
+      if (pfd[s->pc].revents) command(s);
+    }
+
+    if (nsess < NSESS && pfd[n-1].revents) {
+      if ((cd = accept(ld, 0, 0)) < 0) { dprintf(2,"accept() failed\n"); continue; }
+      if (verbose) dprintf(2,"accepted new ftp connection\n");
+      session(cd);
     }
-    close(cd);
   }
 }
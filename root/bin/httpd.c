@@ -1,16 +1,31 @@
 // httpd -- tiny http daemon
 //
-// Usage:  httpd [port]
+// Usage:  httpd [-w workers] [port]
 //
 // Description:
 //   httpd launches a web server allowing remote access to the current directory.
 //   Based on the Nigel's Web server nweb22.c written by Nigel Griffiths.
+//
+//   By default a process is forked for each connection and serves a single request.
+//   With -w, a pool of workers is forked up front, each accepting on the shared
+//   listening socket.  Workers keep HTTP/1.1 connections alive, handle pipelined
+//   requests, and cache small files with their response headers already rendered.
+//   A cached file is checked against the open file's inode and size only (the guest
+//   keeps no modification times), so an edit that leaves the size alone is served
+//   stale until the entry is evicted.
 
 #include <u.h>
 #include <libc.h>
 #include <net.h>
 
-enum { BUFSIZE = 8096 };
+enum {
+  BUFSIZE  = 8096,
+  NCACHE   = 16,        // cached files per worker
+  CACHEMAX = 16*1024,   // largest file cached
+  HDRMAX   = 256,       // room for a pre-rendered header
+  NAMESZ   = 64,
+  IDLE     = 5000,      // keep-alive idle timeout (msec)
+};
 
 char notfound[] =
   "HTTP/1.1 404 Not Found\n"
@@ -23,7 +38,7 @@ char notfound[] =
   "<h1>Not Found</h1>\n"
   "The requested URL was not found on this server.\n"
   "</body></html>\n";
-  
+
 char forbidden[] =
   "HTTP/1.1 403 Forbidden\n"
   "Content-Length: 185\n"
@@ -36,71 +51,211 @@ char forbidden[] =
   "The requested URL, file type or operation is not allowed on this simple static file webserver.\n"
   "</body></html>\n";
 
+char header[] = "HTTP/1.1 200 OK\nServer: httpd/1.0\nContent-Length: %d\nConnection: %s\nContent-Type: %s\n\n";
+
+struct cache {
+  char path[NAMESZ];
+  uint ino, size;
+  uint used;            // lru stamp
+  int hlen;             // header length, header ends at data + HDRMAX
+  char *data;           // HDRMAX + CACHEMAX bytes, allocated on first use
+} cache[NCACHE];
+
+uint clock;
+int workers;
+
 void fatal(char *s)
 {
   printf("fatal: %s\n", s);
   exit(-1);
 }
 
-int web(int sd)
+int reply(int sd, char *s)
 {
-  int fd, i, j, r, len;
-  char *ty;
-  static char buffer[BUFSIZE+1];
+  write(sd, s, strlen(s));
+  return -1;
+}
 
-  buffer[0] = 0; // XXXX hack to suppress unstable!! spew from em.c
-  if ((r = read(sd, buffer, BUFSIZE)) <= 0) { write(sd, forbidden, strlen(forbidden)); return -1; } // read request
-
-  for (i=0; i<r; i++) if (buffer[i] == '\r' || buffer[i] == '\n') buffer[i] = '*'; // remove CF and LF characters
-  if (strncmp(buffer, "GET ", 4) && strncmp(buffer, "get ", 4) ) { write(sd, forbidden, strlen(forbidden)); return -1; }
-  for (i=4; i<BUFSIZE; i++) if (buffer[i] == ' ') { buffer[i] = 0; break; } // null terminate after the second space
-  for (j=0; j<i-1; j++) if (buffer[j] == '.' && buffer[j+1] == '.') { write(sd, forbidden, strlen(forbidden)); return -1; } // check for illegal parent directory use ..
-  if (!strncmp(&buffer[0], "GET /\0", 6) || !strncmp(&buffer[0], "get /\0", 6) ) strcpy(buffer, "GET /index.html"); // convert no filename to index file
-
-  // work out the file type and check we support it
-  len = strlen(buffer);
-  if      (!strcmp(&buffer[len - 4], ".gif"))  ty = "image/gif";
-  else if (!strcmp(&buffer[len - 4], ".jpg"))  ty = "image/jpg";
-  else if (!strcmp(&buffer[len - 5], ".jpeg")) ty = "image/jpeg";
-  else if (!strcmp(&buffer[len - 4], ".png"))  ty = "image/png";
-  else if (!strcmp(&buffer[len - 4], ".ico"))  ty = "image/ico";
-  else if (!strcmp(&buffer[len - 4], ".zip"))  ty = "image/zip";
-  else if (!strcmp(&buffer[len - 3], ".gz"))   ty = "image/gz";
-  else if (!strcmp(&buffer[len - 4], ".tar"))  ty = "image/tar";
-  else if (!strcmp(&buffer[len - 2], ".c"))    ty = "text/c";
-  else if (!strcmp(&buffer[len - 4], ".htm"))  ty = "text/html";
-  else if (!strcmp(&buffer[len - 5], ".html")) ty = "text/html";
-  else { write(sd, forbidden, strlen(forbidden)); return -1; }
-    
-  if ((fd = open(&buffer[5], O_RDONLY)) == -1) { write(sd, notfound, strlen(notfound)); return -1; }
-  len = lseek(fd, 0, SEEK_END);
+// work out the file type and check we support it
+char *type(char *p)
+{
+  int len = strlen(p);
+  if      (!strcmp(&p[len - 4], ".gif"))  return "image/gif";
+  else if (!strcmp(&p[len - 4], ".jpg"))  return "image/jpg";
+  else if (!strcmp(&p[len - 5], ".jpeg")) return "image/jpeg";
+  else if (!strcmp(&p[len - 4], ".png"))  return "image/png";
+  else if (!strcmp(&p[len - 4], ".ico"))  return "image/ico";
+  else if (!strcmp(&p[len - 4], ".zip"))  return "image/zip";
+  else if (!strcmp(&p[len - 3], ".gz"))   return "image/gz";
+  else if (!strcmp(&p[len - 4], ".tar"))  return "image/tar";
+  else if (!strcmp(&p[len - 2], ".c"))    return "text/c";
+  else if (!strcmp(&p[len - 4], ".htm"))  return "text/html";
+  else if (!strcmp(&p[len - 5], ".html")) return "text/html";
+  return 0;
+}
+
+// case insensitive prefix match against a lower case string
+int match(char *p, char *s)
+{
+  while (*s) if ((*p++ | 0x20) != *s++) return 0;
+  return 1;
+}
+
+// decide if the connection persists after this request, p points at the version
+int alive(char *p)
+{
+  int keep = match(p, " http/1.1");
+  while (p = strchr(p, '\n')) {
+    if (!match(++p, "connection:")) continue;
+    for (p += 11; *p == ' '; p++) ;
+    if (match(p, "close")) keep = 0;
+    else if (match(p, "keep-alive")) keep = 1;
+  }
+  return keep;
+}
+
+// return the cache entry for an open file, filling it if missing or stale
+struct cache *cached(int fd, char *path, struct stat *st, char *ty)
+{
+  struct cache *c, *v;
+  char h[HDRMAX];
+
+  if (st->st_size > CACHEMAX || strlen(path) >= NAMESZ) return 0;
+  v = cache;
+  for (c = cache; c < &cache[NCACHE]; c++) {
+    if (!strcmp(c->path, path)) {
+      if (c->ino == st->st_ino && c->size == st->st_size) { c->used = ++clock; return c; }
+      v = c;
+      break;
+    }
+    if (c->used < v->used) v = c;
+  }
+  v->path[0] = 0;
+  v->used = 0;
+  if (!v->data && !(v->data = malloc(HDRMAX + CACHEMAX))) return 0;
+  if (read(fd, v->data + HDRMAX, st->st_size) != st->st_size) return 0;
+  v->hlen = sprintf(h, header, st->st_size, "keep-alive", ty);
+  memcpy(v->data + HDRMAX - v->hlen, h, v->hlen);
+  strcpy(v->path, path);
+  v->ino = st->st_ino;
+  v->size = st->st_size;
+  v->used = ++clock;
+  return v;
+}
+
+// serve one request, returns 1 if the connection should be kept open
+int request(int sd, char *q, int keep)
+{
+  int fd, r; char *p, *path, *ty; struct cache *c; struct stat st;
+  static char buf[BUFSIZE];
+
+  if (strncmp(q, "GET /", 5) && strncmp(q, "get /", 5)) return reply(sd, forbidden);
+  for (p = path = q + 5; *p && *p != ' ' && *p != '\r' && *p != '\n'; p++)
+    if (*p == '.' && p[1] == '.') return reply(sd, forbidden); // check for illegal parent directory use ..
+  if (keep) keep = alive(p);
+  *p = 0;
+  if (!*path) path = "index.html"; // convert no filename to index file
+  if (!(ty = type(path))) return reply(sd, forbidden);
+
+  if ((fd = open(path, O_RDONLY)) < 0) return reply(sd, notfound);
+  if (fstat(fd, &st)) { close(fd); return reply(sd, notfound); }
+  if (workers && (c = cached(fd, path, &st, ty))) {
+    close(fd);
+    if (keep) write(sd, c->data + HDRMAX - c->hlen, c->hlen + c->size);
+    else { dprintf(sd, header, c->size, "close", ty); write(sd, c->data + HDRMAX, c->size); }
+    return keep;
+  }
   lseek(fd, 0, SEEK_SET);
-  dprintf(sd, "HTTP/1.1 200 OK\nServer: httpd/1.0\nContent-Length: %ld\nConnection: close\nContent-Type: %s\n\n", len, ty);
+  dprintf(sd, header, st.st_size, keep ? "keep-alive" : "close", ty);
+  while ((r = read(fd, buf, BUFSIZE)) > 0) write(sd, buf, r);
+  close(fd);
+  return keep;
+}
 
-  while ((r = read(fd, buffer, BUFSIZE)) > 0) write(sd, buffer, r);
-  //sleep(1); // XXX allow socket to drain before signalling the socket is closed
-  close(sd);
+// return the length of a complete request header in p, or 0
+int complete(char *p, int n)
+{
+  int i;
+  for (i = 0; i < n - 1; i++) {
+    if (p[i] != '\n') continue;
+    if (p[i+1] == '\n') return i + 2;
+    if (p[i+1] == '\r' && i + 2 < n && p[i+2] == '\n') return i + 3;
+  }
   return 0;
 }
 
+// serve requests on a connection until it closes, errors, or idles out
+int web(int sd, int keep)
+{
+  int i, r, s, n;
+  struct pollfd pfd;
+  static char buffer[BUFSIZE+1];
+
+  buffer[0] = 0; // XXXX hack to suppress unstable!! spew from em.c
+  s = n = 0;
+  for (;;) {
+    while (!(i = complete(&buffer[s], n - s))) {
+      if (s == n) s = n = 0;
+      else if (s) { for (i = s; i < n; i++) buffer[i - s] = buffer[i]; n -= s; s = 0; }
+      if (n == BUFSIZE) return reply(sd, forbidden);
+      if (keep && !n) {
+        pfd.fd = sd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, IDLE) <= 0) return 0;
+      }
+      if ((r = read(sd, &buffer[n], BUFSIZE - n)) <= 0) return n ? reply(sd, forbidden) : 0; // read request
+      n += r;
+    }
+    buffer[s + i - 1] = 0;
+    if ((r = request(sd, &buffer[s], keep)) <= 0) return r;
+    s += i;
+  }
+}
+
+void worker(int ld)
+{
+  int sd;
+  for (;;) {
+    if ((sd = accept(ld, 0, 0)) < 0) fatal("accept()");
+    web(sd, 1);
+    close(sd);
+  }
+}
+
+void spawn(int ld)
+{
+  int r;
+  if ((r = fork()) < 0) fatal("fork()");
+  if (!r) worker(ld);
+}
+
 int main(int argc, char *argv[])
 {
-  int ld, sd, r;
+  int ld, sd, r, i;
   static struct sockaddr_in addr;
 
+  argc--; argv++;
+  if (argc >= 2 && !strcmp(*argv, "-w")) { if ((workers = atoi(argv[1])) < 1) workers = 1; argc -= 2; argv += 2; }
   if ((ld = socket(AF_INET, SOCK_STREAM,0)) < 0) fatal("socket()");
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  addr.sin_port = htons((argc == 2) ? atoi(argv[1]) : 80);
+  addr.sin_port = htons(argc ? atoi(*argv) : 80);
   if (bind(ld, (struct sockaddr *) &addr, sizeof(addr))) fatal("bind()");
-  if (listen(ld, 1) < 0) fatal("listen()");
+  if (listen(ld, workers ? workers : 1) < 0) fatal("listen()");
+
+  if (workers) {
+    for (i = 0; i < workers; i++) spawn(ld);
+    for (;;) { if (wait() < 0) fatal("wait()"); spawn(ld); } // replace workers that die
+  }
 
   for (;;) {
     if ((sd = accept(ld, 0, 0)) < 0) fatal("accept()");
     if ((r = fork()) < 0) fatal("fork()");
     if (!r) {
       close(ld);
-      return web(sd);
+      web(sd, 0);
+      close(sd);
+      return 0;
     }
     close(sd);
   }
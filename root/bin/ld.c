@@ -0,0 +1,165 @@
+// ld -- link object files
+//
+// Usage:  ld -o exefile file.o ...
+//
+// Description:
+//   ld combines the object files written by c -c into an executable.  The text of each
+//   object follows the text of the one before it, then comes the data of all of them and
+//   then their bss.  Every call to or address of a function an object left undefined is
+//   pointed at the object that defines it, and execution starts at main.
+//
+//   An object holds its text and data as the compiler left them, the functions it defines
+//   and needs, and the instructions to patch: those addressing its data or bss and those
+//   addressing a function it needs.  Only functions are shared, every other global and
+//   every static function stays private to its object.
+//
+//   The libc functions are compiled once into /lib/libc.o.  A program's own sources are
+//   compiled with NOLIBC defined so that libc.h only declares them:
+//       c -c -DNOLIBC main.c
+//       c -c -DNOLIBC util.c
+//       ld -o prog main.o util.o /lib/libc.o
+//   The boot scripts make /lib/libc.o, by hand it is c -c -o /lib/libc.o /lib/libc.c.  The other
+//   headers (net.h, gl.h, forms.h, font.h, ...) still define their functions, so each may be
+//   included by only one object of a program.
+
+#include <u.h>
+#include <libc.h>
+
+enum {
+  NOBJ   = 256,         // objects per link
+  NSYM   = 16*1024,     // functions defined by all objects
+  NHASH  = 4096,        // symbol hash chains (power of 2)
+  R_DATA = -1,          // relocation against the object's data
+  R_BSS  = -2,          // against its bss, otherwise against a symbol
+};
+
+struct ohdr { uint magic, text, data, bss, nsym, nrel, str; };
+struct osym { int val; uint name; };   // text offset or -1 if needed, string table offset
+struct orel { uint off; int sym; };    // instruction text offset, R_DATA, R_BSS or symbol index
+
+struct obj {
+  char *name;
+  struct ohdr *h;
+  char *text, *data, *str;
+  struct osym *sym;
+  struct orel *rel;
+  uint tbase, dbase, bbase; // where its segments land, from the start of text
+} obj[NOBJ];
+int nobj;
+
+struct gsym {
+  char *name;
+  uint val;             // from the start of text
+  struct gsym *next;
+} gsym[NSYM], *ghash[NHASH];
+int ngsym;
+
+void fatal(char *s, char *name)
+{
+  dprintf(2, "ld: %s %s\n", s, name);
+  exit(-1);
+}
+
+int hash(char *s)
+{
+  int h = 0;
+  while (*s) h = h * 31 + *s++;
+  return h & (NHASH-1);
+}
+
+struct gsym *lookup(char *name)
+{
+  struct gsym *g;
+  for (g = ghash[hash(name)]; g; g = g->next) if (!strcmp(g->name, name)) return g;
+  return 0;
+}
+
+void load(struct obj *o, char *file)
+{
+  int f; uint n; char *p; struct stat st; struct ohdr *h;
+
+  if ((f = open(file, O_RDONLY)) < 0 || fstat(f, &st)) fatal("can't open", file);
+  if (!(p = malloc((st.st_size + 7) & -8)) || read(f, p, st.st_size) != st.st_size) fatal("can't read", file); // malloc doesn't align
+  close(f);
+  o->name = file;
+  o->h = h = (struct ohdr *)p;
+  if (st.st_size < sizeof(struct ohdr) || h->magic != 0xC0DE0B1E) fatal("not an object file:", file);
+  n = sizeof(struct ohdr) + h->text + h->data + h->nsym * sizeof(struct osym) + h->nrel * sizeof(struct orel) + h->str;
+  if (n != st.st_size || (h->text & 7) || (h->data & 7) || (h->bss & 7)) fatal("bad object file", file);
+  o->text = p + sizeof(struct ohdr);
+  o->data = o->text + h->text;
+  o->sym = (struct osym *)(o->data + h->data);
+  o->rel = (struct orel *)(o->sym + h->nsym);
+  o->str = (char *)(o->rel + h->nrel);
+  if (h->str && o->str[h->str - 1]) fatal("bad object file", file);
+}
+
+int main(int argc, char *argv[])
+{
+  int f, i, a; uint t, d, b, s; char *out, *image, *name; int *p;
+  struct obj *o; struct osym *y; struct orel *r; struct gsym *g;
+  struct { uint magic, bss, entry, flags; } hdr;
+
+  out = 0;
+  while (--argc && (*++argv)[0] == '-') {
+    if ((*argv)[1] != 'o' || argc < 2) goto usage;
+    out = *++argv; argc--;
+  }
+  if (!out || !argc) { usage: dprintf(2, "usage: ld -o exefile file.o ...\n"); return -1; }
+  if (argc > NOBJ) fatal("too many objects", "");
+  for (; argc; argc--) load(&obj[nobj++], *argv++);
+
+  // lay out text, then data, then bss
+  for (t = 0, o = obj; o < &obj[nobj]; o++) { o->tbase = t; t += o->h->text; }
+  for (d = t, o = obj; o < &obj[nobj]; o++) { o->dbase = d; d += o->h->data; }
+  for (b = d, o = obj; o < &obj[nobj]; o++) { o->bbase = b; b += o->h->bss; }
+  if (!(image = malloc(d))) fatal("out of memory", "");
+  for (o = obj; o < &obj[nobj]; o++) {
+    memcpy(image + o->tbase, o->text, o->h->text);
+    memcpy(image + o->dbase, o->data, o->h->data);
+  }
+
+  // collect the functions defined
+  for (o = obj; o < &obj[nobj]; o++) {
+    for (y = o->sym; y < o->sym + o->h->nsym; y++) {
+      if (y->name >= o->h->str) fatal("bad object file", o->name);
+      if (y->val < 0) continue;
+      name = o->str + y->name;
+      if (lookup(name)) fatal("duplicate function", name);
+      if (ngsym >= NSYM) fatal("too many functions", "");
+      if (y->val >= o->h->text) fatal("bad object file", o->name);
+      g = &gsym[ngsym++];
+      g->name = name;
+      g->val = o->tbase + y->val;
+      g->next = ghash[i = hash(name)];
+      ghash[i] = g;
+    }
+  }
+
+  // patch the pc relative operands
+  for (o = obj; o < &obj[nobj]; o++) {
+    for (r = o->rel; r < o->rel + o->h->nrel; r++) {
+      if (r->off & 3 || r->off >= o->h->text) fatal("bad object file", o->name);
+      s = o->tbase + r->off;
+      p = (int *)(image + s);
+      if (r->sym == R_DATA) a = o->dbase;
+      else if (r->sym == R_BSS) a = o->bbase;
+      else if ((uint)r->sym >= o->h->nsym) fatal("bad object file", o->name);
+      else if (!(g = lookup(name = o->str + o->sym[r->sym].name))) fatal("undefined function", name);
+      else a = g->val;
+      a += (*p >> 8) - s - 4;
+      if (a << 8 >> 8 != a) fatal("segment too large in", o->name);
+      *p = (*p & 0xff) | (a << 8);
+    }
+  }
+  if (!(g = lookup("main"))) fatal("main() not defined", "");
+
+  if ((f = open(out, O_WRONLY | O_CREAT | O_TRUNC)) < 0) fatal("can't open output file", out);
+  hdr.magic = 0xC0DEF00D;
+  hdr.bss   = b - d;
+  hdr.entry = g->val;
+  hdr.flags = 0;
+  if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) || write(f, image, d) != d) fatal("can't write", out);
+  close(f);
+  return 0;
+}
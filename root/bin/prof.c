@@ -0,0 +1,212 @@
+// prof -- profile report from em samples
+//
+// Usage:  prof [-f] [-k kmap] [-u umap] [-p pdir] samples
+//
+// Description:
+//   prof reads the samples written by em -s and prints a flat profile: for each function the
+//   samples in it (self) and the samples with it anywhere on the stack (total).  -f prints the
+//   stacks folded instead, one line per distinct stack, "kernel;main;f;g count", ready for a
+//   flame graph.
+//
+//   Kernel pcs are looked up in kmap and user pcs in umap, symbol maps written by c -g.  Without
+//   a map, or outside every function, a pc shows up as [kernel] or [user].  Samples from all
+//   processes are lumped together unless -p picks those taken with one page directory loaded
+//   (hex, as em records it).
+//   Idle time is reported only as a count.  Return addresses are what em could find on the stack
+//   so the totals are approximate.
+
+#include <u.h>
+#include <libc.h>
+
+enum {
+  NSYM   = 8192,        // functions per map
+  NNAME  = 256*1024,    // function name space per map
+  NSTACK = 32,          // deepest stack in a sample, as in em
+  NBUF   = 64*1024,     // sample words read at once
+  NFOLD  = 16*1024,     // distinct folded stacks
+  NFHASH = 4096,        // folded stack hash chains (power of 2)
+  NFPOOL = 512*1024,    // folded stack words
+  KBASE  = 0xc0000000,  // kernel text is mapped here once paging is on
+  UBASE  = 16,          // user text follows the executable header
+};
+
+struct map {
+  int n;                // functions
+  uint off[NSYM];       // text offset, ascending
+  char *name[NSYM];
+  int self[NSYM+1];     // samples, the last counting pcs outside every function
+  int total[NSYM+1];
+  int mark[NSYM+1];     // last sample counted in total
+  char names[NNAME];
+} kmap, umap;
+
+struct fold {
+  int n;                // frames, outermost first
+  int *f;               // frame ids in fpool
+  int count;
+  struct fold *next;
+} fold[NFOLD], *fhash[NFHASH];
+int nfold;
+int fpool[NFPOOL], nfpool;
+
+uint buf[NBUF];
+int folded;
+int nsample;
+int idle;               // samples em found idle
+
+int xdigit(int c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// read the function lines of a symbol map: "offset F name"
+void loadmap(struct map *m, char *file)
+{
+  int f, i, n, d; uint off; char *p, *e, *q, *s;
+  struct stat st;
+
+  if ((f = open(file, O_RDONLY)) < 0 || fstat(f, &st)) { dprintf(2, "prof: can't open %s\n", file); exit(-1); }
+  if (!(p = malloc(st.st_size + 1)) || read(f, p, st.st_size) != st.st_size) { dprintf(2, "prof: can't read %s\n", file); exit(-1); }
+  close(f);
+  e = p + st.st_size;
+  *e = 0;
+  s = m->names;
+  for (; p < e; p = q + 1) {
+    for (q = p; q < e && *q != '\n'; q++) ;
+    for (off = 0; (d = xdigit(*p)) >= 0; p++) off = off * 16 + d;
+    if (p[0] != ' ' || p[1] != 'F' || p[2] != ' ') continue;
+    p += 3;
+    if ((n = q - p) <= 0 || m->n >= NSYM || s + n + 1 > m->names + NNAME) continue;
+    m->off[m->n] = off;
+    m->name[m->n++] = s;
+    memcpy(s, p, n); s[n] = 0; s += n + 1;
+  }
+  for (i = 1; i < m->n; i++) if (m->off[i] < m->off[i-1]) { dprintf(2, "prof: %s is not in text order\n", file); exit(-1); }
+}
+
+// the function containing a text offset, or m->n if none
+int lookup(struct map *m, uint off)
+{
+  int lo = 0, hi = m->n, mid;
+  if (!m->n || off < m->off[0]) return m->n;
+  while (hi - lo > 1) { mid = (lo + hi) / 2; if (m->off[mid] <= off) lo = mid; else hi = mid; }
+  return lo;
+}
+
+char *fname(int id)
+{
+  if (id > NSYM) { id -= NSYM + 1; return (id < umap.n) ? umap.name[id] : "[user]"; }
+  return (id < kmap.n) ? kmap.name[id] : "[kernel]";
+}
+
+// count one stack, innermost first
+void account(int user, uint *pc, int n)
+{
+  struct map *m = user ? &umap : &kmap;
+  struct fold *fp;
+  int i, j, h, id[NSTACK];
+
+  for (i = 0; i < n; i++) {
+    id[i] = lookup(m, user ? pc[i] - UBASE : (pc[i] >= KBASE ? pc[i] - KBASE : pc[i]));
+    if (!i) m->self[id[i]]++;
+    if (m->mark[id[i]] != nsample) { m->mark[id[i]] = nsample; m->total[id[i]]++; }
+    if (user) id[i] += NSYM + 1;
+  }
+  if (!folded) return;
+  for (h = n, i = 0; i < n; i++) h = h * 31 + id[i];
+  for (fp = fhash[h &= NFHASH-1]; fp; fp = fp->next) {
+    if (fp->n != n) continue;
+    for (j = 0; j < n && fp->f[j] == id[n-1-j]; j++) ;
+    if (j == n) { fp->count++; return; }
+  }
+  if (nfold >= NFOLD || nfpool + n > NFPOOL) { dprintf(2, "prof: too many distinct stacks\n"); exit(-1); }
+  fp = &fold[nfold++];
+  fp->n = n;
+  fp->f = &fpool[nfpool]; nfpool += n;
+  for (j = 0; j < n; j++) fp->f[j] = id[n-1-j];
+  fp->count = 1;
+  fp->next = fhash[h];
+  fhash[h] = fp;
+}
+
+void report(struct map *m, char *mode)
+{
+  int i, j, t, x, s, *order;
+
+  order = malloc((m->n + 1) * sizeof(int));
+  for (i = j = 0; i <= m->n; i++) if (m->total[i]) order[j++] = i;
+  for (t = j, i = 1; i < t; i++) // insertion sort by self, then total
+    for (j = i; j > 0 && (m->self[order[j]] > m->self[order[j-1]] ||
+      (m->self[order[j]] == m->self[order[j-1]] && m->total[order[j]] > m->total[order[j-1]])); j--) {
+      x = order[j]; order[j] = order[j-1]; order[j-1] = x;
+    }
+  if (!t) return;
+  printf("\n%s:\n    self   self%%  total%%  function\n", mode);
+  for (i = 0; i < t; i++) {
+    j = order[i];
+    s = m->self[j] * 1000.0 / nsample;
+    x = m->total[j] * 1000.0 / nsample;
+    printf("%8d  %3d.%d  %3d.%d   %s\n", m->self[j], s / 10, s % 10, x / 10, x % 10, (j < m->n) ? m->name[j] : (m == &umap) ? "[user]" : "[kernel]");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int f, i, n, len, r, user, pick; uint pdir;
+  struct fold *fp;
+  static char line[8192];
+
+  pick = 0; pdir = 0;
+  while (--argc && (*++argv)[0] == '-') {
+    switch ((*argv)[1]) {
+    case 'f': folded = 1; break;
+    case 'k': if (argc < 2) goto usage; loadmap(&kmap, *++argv); argc--; break;
+    case 'u': if (argc < 2) goto usage; loadmap(&umap, *++argv); argc--; break;
+    case 'p': if (argc < 2) goto usage; pick = 1; for (pdir = 0, argv++, argc--, i = 0; xdigit((*argv)[i]) >= 0; i++) pdir = pdir * 16 + xdigit((*argv)[i]); break;
+    default: goto usage;
+    }
+  }
+  if (argc != 1) { usage: dprintf(2, "usage: prof [-f] [-k kmap] [-u umap] [-p pdir] samples\n"); return -1; }
+
+  if ((f = open(*argv, O_RDONLY)) < 0) { dprintf(2, "prof: can't open %s\n", *argv); return -1; }
+  if (read(f, buf, 8) != 8 || buf[0] != 0x666f7270) { dprintf(2, "prof: %s is not an em sample file\n", *argv); return -1; }
+  if (!folded) printf("%d cycles per sample\n", buf[1]);
+
+  // records never span more than NSTACK+2 words, keep any partial one for the next read
+  for (len = 0; (r = read(f, (char *)(buf + len), (NBUF - len) * 4)) > 0; ) {
+    len += r / 4;
+    for (i = 0; i + 2 <= len && i + 2 + (n = buf[i] & 0xffff) <= len; i += n + 2) {
+      if (!n) { idle += buf[i+1]; continue; }
+      if (n > NSTACK) { dprintf(2, "prof: bad sample\n"); return -1; }
+      user = buf[i] >> 31;
+      if (pick && buf[i+1] != pdir) continue;
+      nsample++;
+      account(user, buf + i + 2, n);
+    }
+    for (n = 0; i < len; ) buf[n++] = buf[i++];
+    len = n;
+  }
+  close(f);
+  if (!nsample) { dprintf(2, "prof: no samples\n"); return -1; }
+
+  if (folded) {
+    for (fp = fold; fp < &fold[nfold]; fp++) {
+      strcpy(line, (fp->f[0] > NSYM) ? "user" : "kernel");
+      for (i = 0; i < fp->n; i++) {
+        if (strlen(line) + strlen(fname(fp->f[i])) + 16 > sizeof(line)) break;
+        strcat(line, ";"); strcat(line, fname(fp->f[i]));
+      }
+      n = strlen(line);
+      n += sprintf(line + n, " %d\n", fp->count);
+      write(1, line, n);
+    }
+    return 0;
+  }
+  printf("%d samples, %d more idle\n", nsample, idle);
+  report(&kmap, "kernel");
+  report(&umap, "user");
+  return 0;
+}
@@ -1,4 +1,19 @@
 // mkfs.c - make file system
+//
+// Usage:  mkfs [-f] [-e] [-u] [-s size] fs rootdir
+//
+// Directories too big for one block are written in the indexed (hashed) format, -f keeps them all flat.
+// With -e regular files are extent mapped: each file is one run of blocks listed by its start and length.
+// With -u an existing image is updated in place: the layout is rebuilt the same way but only the parts that
+// differ from what is already in the image are written.  The image is never shortened.  Each file's inode
+// records its size and host mtime, so a file whose inode is unchanged is not read or compared at all (em
+// loads the image read only, so the guest never changes it underneath).  mtimes come from the linux host
+// only; elsewhere every file is compared block by block.
+// With -s the image file is made size bytes long (k or m suffix), at most the DISKSZ disk the kernel and em
+// expect.  The space past the contents is a hole, it reserves nothing.
+//
+// A new image is written sparse: zero blocks are seeked over rather than written.  The free block count under
+// each bitmap block goes in the root inode so the kernel need not scan the bitmap to learn it.
 
 #include <u.h>
 #include <libc.h>
@@ -9,19 +24,29 @@ enum {
   DIRSIZ  = 252,
   NDIR    = 480,         // 1.9 MB
   NIDIR   = 512,         //   2 GB
-  NIIDIR  = 8,           //  32 GB
+  NIIDIR  = 8,           //  32 GB (but sizes are 32 bits)
   NIIIDIR = 4,           //  16 TB
+  NDINDEX = 512,         // indexed directory hash slots
+  DMAXDEPTH = 9,         // log2(NDINDEX)
+  D_INDEX = 1,           // dinode flags
+  D_EXTENT = 2,
+  D_FREESUM = 4,         // root only: pad[] holds the free block count under each bitmap block
+  D_MTIME = 8,           // file: pad[0] holds the host mtime
+  NBITMAP = 16,
+  BPB     = 4096*8,      // blocks per bitmap block
+  DISKSZ  = 4*1024*1024, // disk size the kernel expects (must match FSSIZE)
 };
 
 struct dinode {          // 4K disk inode structure
   ushort mode;           // file mode
   uint nlink;            // number of links to inode in file system
   uint size;             // size of file
-  uint pad[17];
+  uint flags;            // D_INDEX, D_EXTENT, D_FREESUM, D_MTIME
+  uint pad[16];          // root: free block summary, file: host mtime
   uint dir[NDIR];        // data block addresses
   uint idir[NIDIR];      // 2 GB max file size
-  uint iidir[NIIDIR];    // not yet implemented
-  uint iiidir[NIIIDIR];  // not yet implemented
+  uint iidir[NIIDIR];    // double indirect
+  uint iiidir[NIIIDIR];  // triple indirect, never needed for a 32 bit size
 };
 
 struct direct { // disk directory entry structure
@@ -29,9 +54,34 @@ struct direct { // disk directory entry structure
   char d_name[DIRSIZ];
 };
 
+struct dindex {          // first block of an indexed directory
+  uint depth;            // global depth
+  uint blk[NDINDEX];     // leaf block within the directory for each hash value
+};
+
+struct dleaf {           // indexed directory leaf block
+  ushort depth;          // local depth
+  ushort used;           // bytes of entries
+  char data[4092];
+};
+
+struct dent {            // indexed directory entry
+  uint ino;
+  ushort len;            // record length, a multiple of 4
+  ushort nlen;           // name length
+  char name[4];          // nlen bytes and a nul
+};
+
 uchar buf[BUFSZ];
+uchar old[BUFSZ];        // existing image contents when updating
+uchar *ibuf;             // indexed directory image
 uint bn;
 int disk;
+int flat;
+int extents;
+int update;
+uint pos;                // image offset being written
+uint end;                // image size so far
 
 void xstrncpy(char *s, char *t, int n) // no return value unlike strncpy
 {
@@ -39,54 +89,168 @@ void xstrncpy(char *s, char *t, int n) // no return value unlike strncpy
   while (n-- > 0) *s++ = 0;
 }
 
-void write_disk(void *b, uint n)
+// write at pos, filling any hole left behind it with zeros if the file system will not seek past the end
+void put_disk(uchar *p, uint n)
+{
+  int i; uint r;
+  static uchar zeros[4096];
+  if (lseek(disk, pos, SEEK_SET) != pos) { dprintf(2, "lseek(%d) failed\n", pos); exit(-1); }
+  for (r = n; r; r -= i, p += i) {
+    if ((i = write(disk, p, r)) > 0) continue;
+    if (r != n || end >= pos) { dprintf(2, "write(%d) failed\n", r); exit(-1); }
+    for (lseek(disk, end, SEEK_SET); end < pos; end += i)
+      if ((i = write(disk, zeros, (pos - end > 4096) ? 4096 : pos - end)) <= 0) { dprintf(2, "write(%d) failed\n", pos - end); exit(-1); }
+    i = 0;
+  }
+  if (pos + n > end) end = pos + n;
+}
+
+// write n bytes at pos, returns zero if nothing needed writing
+int write_disk(void *b, uint n)
 {
-  uint i;
-  while (n) {
-    if ((i = write(disk, b, n)) < 0) { dprintf(2, "write(%d) failed\n",n); exit(-1); }
-    b += i; n -= i;
+  uint m, i; int w = 0;
+  for (; n; n -= m, b += m, pos += m) {
+    m = (n > BUFSZ) ? BUFSZ : n;
+    if (update) {
+      lseek(disk, pos, SEEK_SET);
+      if (read(disk, old, m) == m && !memcmp(old, b, m)) continue; // unchanged
+    } else {
+      for (i = 0; i < m && !((uchar *)b)[i]; i++) ;
+      if (i == m) continue; // leave a hole
+    }
+    put_disk(b, m);
+    w = 1;
   }
+  return w;
+}
+
+void seek_disk(uint off)
+{
+  pos = off;
 }
 
-void write_meta(uint size, uint mode, uint nlink)
+// write the inode followed by its indirect blocks, the data is written next.  layout:
+//   inode, double indirect blocks, single indirect blocks, data
+// returns nonzero if an update found the same stamped inode, so the data is already in place
+int write_meta(uint size, uint mode, uint nlink, uint flags, uint mtime)
 {
-  uint i, b, dir, idir;
+  uint i, j, k, b, dir, leaf, top, data; int same;
   struct dinode inode;
   static uint iblock[1024];
     
-  // compute blocks, direct, and indirect
-  b = (size + 4095) / 4096;
+  // compute blocks, direct, single indirect, and double indirect
+  b = size / 4096 + ((size & 4095) != 0);
   dir = (b > NDIR) ? NDIR : b;
-  idir = (b + 1023 - NDIR) / 1024;
+  leaf = (b - dir + 1023) / 1024;
+  top = (leaf > NIDIR) ? (leaf - NIDIR + 1023) / 1024 : 0;
 
   // write inode
   memset(&inode, 0, 4096);
   inode.mode = mode;
   inode.nlink = nlink;
   inode.size = size;
+  inode.flags = flags;
+  if (mtime) { inode.flags |= D_MTIME; inode.pad[0] = mtime; }
   bn++;
-  for (i=0; i<dir;  i++) inode.dir[i] = bn + idir + i;
-  for (i=0; i<idir; i++) inode.idir[i] = bn++;
-  write_disk(&inode, 4096);
-
-  // write indirect blocks
-  b += bn;
-  bn += dir;
-  while (bn < b) {
-    for (i=0; i<1024; i++) iblock[i] = (bn < b) ? bn++ : 0;
+  if (flags & D_EXTENT) { // data follows as a single run
+    if (b) { inode.dir[0] = bn; inode.dir[1] = b; }
+    same = !write_disk(&inode, 4096) && update && mtime;
+    bn += b;
+    return same;
+  }
+  data = bn + top + leaf;
+  for (i=0; i<dir; i++) inode.dir[i] = data + i;
+  for (i=0; i<leaf && i<NIDIR; i++) inode.idir[i] = bn + top + i;
+  for (i=0; i<top; i++) inode.iidir[i] = bn + i;
+  same = !write_disk(&inode, 4096) && update && mtime;
+
+  // write double indirect blocks
+  for (i=0; i<top; i++) {
+    for (j=0; j<1024; j++) { k = NIDIR + i*1024 + j; iblock[j] = (k < leaf) ? bn + top + k : 0; }
     write_disk(iblock, 4096);
   }
+
+  // write single indirect blocks
+  for (i=0; i<leaf; i++) {
+    for (j=0; j<1024; j++) { k = dir + i*1024 + j; iblock[j] = (k < b) ? data + k : 0; }
+    write_disk(iblock, 4096);
+  }
+  bn = data + b;
+  return same;
+}
+
+// must match the kernel
+uint dir_hash(char *name)
+{
+  uint h = 5381; int n;
+  for (n = 0; n < DIRSIZ && name[n]; n++) h = (h * 33) ^ (name[n] & 0xff);
+  return h;
+}
+
+// add an entry to the indexed directory image, splitting leaves as needed
+int index_add(uint *nb, char *name, uint ino)
+{
+  struct dindex *x = (struct dindex *)ibuf;
+  struct dleaf *l, *nl;
+  struct dent *e;
+  uint lb, d, i, n, m, len;
+  char *p, *q, *end;
+
+  for (n = 0; n < DIRSIZ && name[n]; n++) ;
+  m = (n + 12) & -4;
+  for (;;) {
+    lb = x->blk[dir_hash(name) & ((1 << x->depth) - 1)];
+    l = (struct dleaf *)(ibuf + lb * 4096);
+    if (l->used + m <= sizeof(l->data)) {
+      e = (struct dent *)(l->data + l->used);
+      e->ino = ino;
+      e->len = m;
+      e->nlen = n;
+      memcpy(e->name, name, n);
+      e->name[n] = 0;
+      l->used += m;
+      return 0;
+    }
+    if ((d = l->depth) == x->depth) {
+      if (d == DMAXDEPTH) return -1;
+      for (i = 0; i < 1 << d; i++) x->blk[i + (1 << d)] = x->blk[i];
+      x->depth++;
+    }
+    nl = (struct dleaf *)(ibuf + *nb * 4096);
+    memset(nl, 0, 4096);
+    l->depth = nl->depth = d + 1;
+    end = l->data + l->used;
+    for (p = q = l->data; p < end; p += len) {
+      e = (struct dent *)p;
+      len = e->len;
+      if ((dir_hash(e->name) >> d) & 1) { memcpy(nl->data + nl->used, p, len); nl->used += len; }
+      else for (i = 0; i < len; i++) *q++ = p[i];
+    }
+    l->used = q - l->data;
+    for (i = 0; i < 1 << x->depth; i++) if (x->blk[i] == lb && ((i >> d) & 1)) x->blk[i] = *nb;
+    (*nb)++;
+  }
+}
+
+// build the indexed image of a directory in ibuf, returns its size or 0 if it will not fit.
+// the layout depends only on the names so it can be rebuilt once the inode numbers are known
+uint index_dir(struct direct *de, struct direct *end)
+{
+  uint nb = 2;
+  memset(ibuf, 0, 2 * 4096);
+  ((struct dindex *)ibuf)->blk[0] = 1;
+  for (; de < end; de++) if (index_add(&nb, de->d_name, de->d_ino)) return 0;
+  return nb * 4096;
 }
 
 add_dir(uint parent, struct direct *sp)
 {
-  uint size, dsize, dseek, nlink = 2;
-  int f, n, i;
+  uint size, dsize, dseek, isize, n, mtime, nlink = 2;
+  int f, i;
   struct direct *de, *p;
   DIR *d;
   struct dirent *dp;
   struct stat st;
-  static uchar zeros[4096];
     
   // build directory
   de = sp;
@@ -106,12 +270,17 @@ add_dir(uint parent, struct direct *sp)
   parent = bn;
   
   // write inode
-  write_meta(dsize = (uint)sp - (uint)de, S_IFDIR, nlink);  
-  dseek = (bn - ((dsize + 4095) / 4096)) * 4096;
+  dsize = (uint)sp - (uint)de;
+  isize = (!flat && dsize > 4096) ? index_dir(de, sp) : 0;
+  write_meta(isize ? isize : dsize, S_IFDIR, nlink, isize ? D_INDEX : 0, 0);
+  dseek = (bn - (((isize ? isize : dsize) + 4095) / 4096)) * 4096;
 
   // write directory
-  write_disk(de, dsize);
-  if (dsize & 4095) write_disk(zeros, 4096 - (dsize & 4095));
+  if (isize) write_disk(ibuf, isize);
+  else {
+    write_disk(de, dsize);
+    seek_disk(bn * 4096);
+  }
 
   // add directory contents
   for (p = de + 2; p < sp; p++) {
@@ -121,49 +290,93 @@ add_dir(uint parent, struct direct *sp)
       add_dir(parent, sp);
       chdir("..");
     } else { // file
-      write_meta(size, S_IFREG, 1);
-      if (size) {
-        if ((f = open(p->d_name, O_RDONLY)) < 0) { dprintf(2, "open(%s) failed\n", p->d_name); exit(-1); }
+      if ((f = open(p->d_name, O_RDONLY)) < 0) { dprintf(2, "open(%s) failed\n", p->d_name); exit(-1); }
+      mtime = 0;
+#ifdef LINUX
+      mtime = xmtime(f);
+#endif
+      if (!write_meta(size, S_IFREG, 1, extents ? D_EXTENT : 0, mtime)) { // else the image already holds it
         for (n = size; n; n -= i) {
           if ((i = read(f, buf, (n > BUFSZ) ? BUFSZ : n)) < 0) { dprintf(2, "read(%s) failed\n", p->d_name); exit(-1); }
           write_disk(buf, i);
         }
-        close(f);
-        if (size & 4095) write_disk(zeros, 4096 - (size & 4095));
       }
+      close(f);
+      seek_disk(bn * 4096);
     }
   }
   
   // update directory
-  lseek(disk, dseek, SEEK_SET);
-  write_disk(de, dsize);
-  lseek(disk, 0, SEEK_END);
+  seek_disk(dseek);
+  if (isize) { index_dir(de, sp); write_disk(ibuf, isize); }
+  else write_disk(de, dsize);
+  seek_disk(bn * 4096);
+}
+
+// record how many blocks below size are free under each bitmap block in the root inode
+void write_summary(uint size)
+{
+  int k; uint b, e;
+  struct dinode root;
+  seek_disk(16 * 4096);
+  if (lseek(disk, pos, SEEK_SET) != pos || read(disk, &root, 4096) != 4096) { dprintf(2, "read(root) failed\n"); exit(-1); }
+  for (k = 0; k < NBITMAP; k++) {
+    b = (k * BPB > bn) ? k * BPB : bn;
+    e = ((k + 1) * BPB < size / 4096) ? (k + 1) * BPB : size / 4096;
+    root.pad[k] = (b < e) ? e - b : 0;
+  }
+  root.flags |= D_FREESUM;
+  write_disk(&root, 4096);
 }
 
 int main(int argc, char *argv[])
 {
   struct direct *sp;
+  struct stat st;
+  uint size = 0;
+  char *s;
   static char cwd[PATH_MAX];
   if (sizeof(struct dinode) != 4096) { dprintf(2, "sizeof(struct dinode) %d != 4096\n", sizeof(struct dinode)); return -1; }
   
-  if (argc != 3) { dprintf(2, "Usage: mkfs fs rootdir\n"); return -1; }
-  if ((disk = open(argv[1], O_RDWR | O_CREAT | O_TRUNC)) < 0) { dprintf(2, "open(%s) failed\n", argv[1]); return -1; }
+  for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+    if (!strcmp(argv[1], "-f")) flat = 1;
+    else if (!strcmp(argv[1], "-e")) extents = 1;
+    else if (!strcmp(argv[1], "-u")) update = 1;
+    else if (!strcmp(argv[1], "-s") && argc > 2) {
+      for (s = argv[2]; *s >= '0' && *s <= '9'; s++) size = size * 10 + *s - '0';
+      if (*s == 'k' || *s == 'K') size *= 1024; else if (*s == 'm' || *s == 'M') size *= 1024*1024;
+      argc--; argv++;
+    }
+    else break;
+  }
+  if (argc != 3) { dprintf(2, "Usage: mkfs [-f] [-e] [-u] [-s size] fs rootdir\n"); return -1; }
+  if (size > DISKSZ) { dprintf(2, "mkfs: -s %d is larger than the %d byte disk\n", size, DISKSZ); return -1; }
+  if ((disk = open(argv[1], O_RDWR | O_CREAT | (update ? 0 : O_TRUNC))) < 0) { dprintf(2, "open(%s) failed\n", argv[1]); return -1; }
   if ((int)(sp = (struct direct *) sbrk(16*1024*1024)) == -1) { dprintf(2, "sbrk() failed\n"); return -1; }
+  if ((int)(ibuf = sbrk((NDINDEX + 1) * 4096)) == -1) { dprintf(2, "sbrk() failed\n"); return -1; }
+  if (update && !fstat(disk, &st)) end = st.st_size;
 
-  // write zero bitmap
-  write_disk(buf, BUFSZ);
+  // the bitmap is written last, a new image leaves a hole for it and an update leaves the old one alone
+  seek_disk(BUFSZ);
   
   // populate file system
   getcwd(cwd, sizeof(cwd));
   chdir(argv[2]);
   add_dir(bn = 16, sp);
   chdir(cwd);
+  if (size && size < bn * 4096) { dprintf(2, "mkfs: contents need %d bytes, more than -s %d\n", bn * 4096, size); return -1; }
 
   // update bitmap
+  memset(buf, 0, BUFSZ);
   memset(buf, 0xff, bn / 8);
   if (bn & 7) buf[bn / 8] = (1 << (bn & 7)) - 1;
-  lseek(disk, 0, SEEK_SET);
-  write_disk(buf, (bn + 7) / 8);
+  seek_disk(0);
+  write_disk(buf, update ? BUFSZ : (bn + 7) / 8);
+  write_summary(DISKSZ);
+
+  // the image ends with the last block, holes and all
+  if (size < bn * 4096) size = bn * 4096;
+  if (end < size) { seek_disk(size - 1); put_disk((uchar *)"", 1); }
   close(disk);
   return 0;
 }
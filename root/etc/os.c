@@ -7,7 +7,8 @@ enum {
   NOFILE  = 16,         // open files per process
   NFILE   = 100,        // open files per system
   NBUF    = 10,         // size of disk block cache
-  NINODE  = 50,         // maximum number of active i-nodes  XXX make this more dynamic ... 
+  IMEM    = 32*1024,    // memory per cached i-node, the cache is sized from memory
+  NIHASH  = 256,        // i-node cache hash chains (power of 2)
   NDEV    = 10,         // maximum major device number
   USERTOP = 0xc0000000, // end of user address space
   P2V     = +USERTOP,   // turn a physical address into a virtual address
@@ -15,6 +16,17 @@ enum {
   FSSIZE  = PAGE*1024,  // XXX
   MAXARG  = 256,        // max exec arguments
   STACKSZ = 0x800000,   // user stack size (8MB)
+  NRNODE  = 32,         // remote files with cached attributes
+  NRBUF   = 32,         // remote file block cache (a page each)
+  NRREQ   = 16,         // remote requests in flight (power of 2)
+  RPATH   = 128,        // longest remote path
+  RLEASE  = 30,         // remote attribute lease (ticks)
+  RAHEAD  = 4,          // remote blocks to read ahead
+  NDCACHE = 128,        // directory name cache entries (power of 2)
+  NDHASH  = 64,         // directory name cache hash chains (power of 2)
+  DCNAME  = 28,         // longest cached name + 1
+  NDINDEX = 512,        // indexed directory hash slots (power of 2)
+  DMAXDEPTH = 9,        // log2(NDINDEX)
 };
 
 enum { // page table entry flags   XXX refactor vs. i386
@@ -80,6 +92,8 @@ struct stat {
 // disk file system format
 enum {
   ROOTINO  = 16,         // root i-number
+  NBITMAP  = 16,         // free block bitmap blocks at the start of the disk
+  BPB      = 4096*8,     // blocks per bitmap block
   NDIR     = 480,
   NIDIR    = 512,
   NIIDIR   = 8,
@@ -92,11 +106,12 @@ struct dinode { // on-disk inode structure
   ushort mode;           // file mode
   uint nlink;            // number of links to inode in file system
   uint size;             // size of file
-  uint pad[17];
+  uint flags;            // D_INDEX, D_EXTENT, D_FREESUM, D_MTIME
+  uint pad[16];          // root: free block summary, file: host mtime (D_MTIME)
   uint dir[NDIR];        // data block addresses
   uint idir[NIDIR];
-  uint iidir[NIIDIR];    // XXX not implemented
-  uint iiidir[NIIIDIR];  // XXX not implemented
+  uint iidir[NIIDIR];    // double indirect
+  uint iiidir[NIIIDIR];  // triple indirect, beyond the reach of a 32 bit file size
 };
 
 struct direct { // directory is a file containing a sequence of direct structures.
@@ -104,6 +119,42 @@ struct direct { // directory is a file containing a sequence of direct structure
   char d_name[DIRSIZ];
 };
 
+enum { // disk inode flags
+  D_INDEX  = 1,          // directory is indexed
+  D_EXTENT = 2,          // dir[] holds {start, length} runs of blocks instead of block addresses
+  D_FREESUM = 4,         // root only: pad[] holds the free block count under each bitmap block, left by mkfs
+  D_MTIME  = 8,          // pad[0] holds the host mtime of the file mkfs copied in, for mkfs -u
+};
+
+// An indexed directory is an extendible hash.  Its first block maps the low depth bits of a name's hash to a leaf
+// block, and each leaf holds packed variable length entries for every name whose low (local) depth bits match.
+struct dindex {
+  uint depth;            // global depth
+  uint blk[NDINDEX];     // leaf block within the directory for each hash value
+};
+
+struct dleaf {
+  ushort depth;          // local depth
+  ushort used;           // bytes of entries
+  char data[PAGE-4];
+};
+
+struct dent { // indexed directory entry
+  uint ino;
+  ushort len;            // record length, a multiple of 4
+  ushort nlen;           // name length
+  char name[4];          // nlen bytes and a nul
+};
+
+struct dcache { // name cache entry, maps (directory, name) to an inode number
+  uint dp;               // directory inode number, 0 if free
+  uint ino;              // inode number, 0 if the name is known to be absent
+  uint off;              // offset of the entry in the directory
+  int used;              // referenced since the hand last passed
+  struct dcache *next;   // hash chain
+  char name[DCNAME];
+};
+
 struct pipe {
   char data[PIPESIZE];
   uint nread;            // number of bytes read
@@ -112,6 +163,13 @@ struct pipe {
   int writeopen;         // write fd is still open
 };
 
+struct imap { // block addresses of an inode, as on disk
+  uint dir[NDIR];
+  uint idir[NIDIR];
+  uint iidir[NIIDIR];
+  uint iiidir[NIIIDIR];
+};
+
 struct inode { // in-memory copy of an inode
   uint inum;             // inode number
   int ref;               // reference count
@@ -119,8 +177,52 @@ struct inode { // in-memory copy of an inode
   ushort mode;           // copy of disk inode
   uint nlink;
   uint size;
-  uint dir[NDIR];
-  uint idir[NIDIR];
+  uint dflags;           // copy of disk inode flags
+  uint major;            // device numbers, dir[0] and dir[1] on disk
+  uint minor;
+  uint last;             // last block allocated to the inode, where the next allocation starts looking
+  uint leaf;             // 1 + index of the single indirect block cached in leafaddr, 0 if none
+  uint leafaddr;
+  uint mod;              // version of the contents for exec's compile cache, 0 until exec asks
+  struct imap *map;      // block addresses, a page loaded on first use and dropped with the last reference
+  struct inode *hnext;   // hash chain
+  struct inode *prev;    // LRU list of unreferenced inodes
+  struct inode *next;
+};
+
+enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_FSTAT, M_SYNC }; // remote file system messages
+
+struct rattr { // remote file attributes as sent by the server
+  struct stat st;
+  uint mtime;            // zero if the server cannot tell
+};
+
+struct rnode { // remote file, one per path
+  char path[RPATH];
+  int ref;
+  struct rattr a;
+  uint lease;            // ticks when the attributes expire
+  uint next;             // offset a sequential read would continue from
+};
+
+enum { RB_EMPTY, RB_BUSY, RB_VALID };
+struct rbuf { // cached block of a remote file
+  struct rnode *rn;      // zero when used as a bounce buffer
+  uint blk;
+  int state;             // RB_BUSY while a read is in flight
+  int stale;             // written to while the read was in flight
+  int len;               // valid bytes, short at end of file
+  uint used;             // LRU stamp
+  char *data;
+};
+
+struct rreq { // remote request awaiting its reply
+  int id;                // zero if free
+  int r;                 // result from the reply
+  int done;
+  int discard;           // nobody waits, free on reply
+  struct rbuf *b;        // data lands here
+  struct rattr a;        // attributes land here
 };
 
 enum { FD_NONE, FD_PIPE, FD_INODE, FD_SOCKET, FD_RFS };
@@ -132,6 +234,8 @@ struct file {
   struct pipe *pipe;     // XXX make vnode
   struct inode *ip;
   uint off;
+  struct rnode *rn;      // remote file
+  int fh;                // file server handle
 };
 
 enum { I_BUSY = 1, I_VALID = 2 };
@@ -187,11 +291,26 @@ char *memdisk;
 struct input_s input;    // XXX do this some other way?
 struct buf bcache[NBUF];
 struct buf bfreelist;    // linked list of all buffers, through prev/next.   bfreelist.next is most recently used
-struct inode inode[NINODE]; // inode cache XXX make dynamic and eventually power of 2, look into iget()
+uint bfreen[NBITMAP];    // free blocks per bitmap block
+int bcounted;            // bfreen[] is valid
+uint bhint;              // where the next allocation without a goal starts looking
+struct inode *inode;     // inode cache, sized from memory by iinit()
+uint ninode;
+uint modclock;           // last inode version handed out
+struct inode *ihash[NIHASH];
+struct inode ifreelist;  // unreferenced inodes, through prev/next.  ifreelist.next is most recently used
 struct file file[NFILE];
+struct dcache dcache[NDCACHE];
+struct dcache *dchash[NDHASH];
+uint dchand;             // next name cache entry to consider for reuse
 int nextpid;
 
 rfsd = -1; // XXX will be set on mount, XXX total redesign?
+int rfsid, rfsreading;   // last request id, a process is reading replies
+uint rfsclock;           // remote block LRU clock
+struct rnode rnode[NRNODE];
+struct rbuf rbuf[NRBUF];
+struct rreq rreq[NRREQ];
 
 // *** Code ***
 
@@ -364,6 +483,21 @@ iderw(struct buf *b) // XXX rename?!
   b->flags |= B_VALID;
 }
 
+// the contents of a sector to be read in place, bypassing the buffer cache like idebulk()
+char *idepeek(uint sector)
+{
+  if (sector >= (FSSIZE / PAGE)) panic("idepeek: sector out of range");
+  return memdisk + sector*PAGE;
+}
+
+// read n consecutive blocks straight into dst, bypassing the buffer cache.  the disk is always current since
+// buffers are written through
+idebulk(uint sector, char *dst, uint n)
+{
+  if (sector + n > (FSSIZE / PAGE) || sector + n < sector) panic("idebulk: sector out of range");
+  memcpy(dst, memdisk + sector*PAGE, n*PAGE);
+}
+
 // buffer cache:
 // The buffer cache is a linked list of buf structures holding cached copies of disk block contents.  Caching disk blocks.
 // in memory reduces the number of disk reads and also provides a synchronization point for disk blocks used by multiple processes.
@@ -467,7 +601,7 @@ brelse(struct buf *b)
 //   Names
 
 // zero a block
-bzero(uint b)  // XXX only called in bfree
+bzero(uint b)
 {
   struct buf *bp;
   bp = bread(b);
@@ -476,38 +610,79 @@ bzero(uint b)  // XXX only called in bfree
   brelse(bp);
 }
 
-// allocate a disk block
-uint balloc()
+// count the free blocks under each bitmap block, ignoring any beyond the end of the disk.  a summary left
+// in the root inode by mkfs saves the scan, it is used once and cleared since it goes stale as blocks move
+bcount()
+{
+  int k; uint b, e; struct buf *bp; struct dinode *dip;
+
+  bp = bread(ROOTINO);
+  dip = (struct dinode *)bp->data;
+  if (dip->flags & D_FREESUM) {
+    for (k = 0; k < NBITMAP; k++) {
+      if ((e = (k + 1) * BPB) > FSSIZE/PAGE) e = FSSIZE/PAGE;
+      b = k * BPB;
+      bfreen[k] = (b >= e) ? 0 : (dip->pad[k] < e - b) ? dip->pad[k] : e - b;
+    }
+    dip->flags &= ~D_FREESUM;
+    bwrite(bp);
+    brelse(bp);
+    bcounted = 1;
+    return;
+  }
+  brelse(bp);
+  for (k = 0; k < NBITMAP; k++) {
+    bfreen[k] = 0;
+    if ((e = (k + 1) * BPB) > FSSIZE/PAGE) e = FSSIZE/PAGE;
+    if ((b = k * BPB) >= e) continue;
+    bp = bread(k);
+    for (; b < e; b++) if (!(bp->data[(b % BPB) / 8] & (1 << (b & 7)))) bfreen[k]++;
+    brelse(bp);
+  }
+  bcounted = 1;
+}
+
+// allocate a disk block, the first free one at or after goal (or the hint), skipping full bitmap blocks and
+// full words.  the block is not zeroed
+uint balloc(uint goal)
 {
-  int b, bi, bb;
+  int k, n; uint b, e, *a;
   struct buf *bp;
 
-  for (b = 0; b < 16; b++) {
-    bp = bread(b);
-    for (bi = 0; bi < 4096; bi++) {
-      if (bp->data[bi] == 0xff) continue;
-      for (bb = 0; bb < 8; bb++) {
-        if (bp->data[bi] & (1 << bb)) continue; // is block free?
-        bp->data[bi] |= (1 << bb);  // mark block in use
+  if (!bcounted) bcount();
+  if (!goal || goal >= FSSIZE/PAGE) goal = bhint;
+  k = goal / BPB;
+  for (n = 0; n <= NBITMAP; n++, k = (k + 1) % NBITMAP) { // the goal's bitmap block comes round twice
+    if (!bfreen[k]) continue;
+    if ((e = (k + 1) * BPB) > FSSIZE/PAGE) e = FSSIZE/PAGE;
+    b = n ? k * BPB : goal;
+    bp = bread(k);
+    a = (uint *)bp->data;
+    while (b < e) {
+      if (a[(b % BPB) / 32] == -1) { b = (b | 31) + 1; continue; }
+      if (!(a[(b % BPB) / 32] & (1 << (b & 31)))) {
+        a[(b % BPB) / 32] |= 1 << (b & 31);  // mark block in use
         bwrite(bp);
         brelse(bp);
-        return b*(4096*8) + bi*8 + bb;
+        bfreen[k]--;
+        bhint = b + 1;
+        return b;
       }
+      b++;
     }
     brelse(bp);
   }
   panic("balloc: out of blocks");
 }
 
-// free a disk block
+// free a disk block.  its contents are left as they are, whoever allocates it next zeroes it if they need to
 bfree(uint b)
 {
   int bi, m;
   struct buf *bp;
 
-  bzero(b);
-
-  bp = bread(b / (4096*8));
+  bp = bread(b / BPB);
+  bfreen[b / BPB]++;
   m = 1 << (b & 7);
   b = (b / 8) & 4095;
   if (!(bp->data[b] & m)) panic("freeing free block");
@@ -524,8 +699,10 @@ bfree(uint b)
 // to inodes shared between multiple processes.
 // 
 // ip->ref counts the number of pointer references to this cached inode; references are typically kept in
-// struct file and in u->cwd.  When ip->ref falls to zero, the inode is no longer cached.  It is an error
-// to use an inode without holding a reference to it.
+// struct file and in u->cwd.  It is an error to use an inode without holding a reference to it.  When ip->ref
+// falls to zero the inode stays cached, valid, on an LRU list from which iget() recycles the oldest.  Cached
+// inodes are found through a hash on the inode number.  They hold only the metadata, the block addresses are
+// loaded into ip->map when first needed and let go with the last reference.
 //
 // Processes are only allowed to read and write inode metadata and contents when holding the inode's lock,
 // represented by the I_BUSY flag in the in-memory copy.  Because inode locks are held during disk accesses, 
@@ -537,29 +714,53 @@ bfree(uint b)
 // return pointers to *unlocked* inodes.  It is the callers' responsibility to lock them before using them.
 // A non-zero ip->ref keeps these unlocked inodes in the cache.
 
+// size the inode cache from memory and put every entry on the free list
+iinit()
+{
+  struct inode *ip;
+
+  ninode = (mem_sz - FSSIZE) / IMEM;
+  inode = mem_top; // never freed, carve it out before anything else is allocated
+  mem_top += (ninode * sizeof(struct inode) + PAGE-1) & -PAGE;
+  ifreelist.prev = ifreelist.next = &ifreelist;
+  for (ip = inode; ip < &inode[ninode]; ip++) {
+    memset(ip, 0, sizeof(struct inode));
+    ip->next = ifreelist.next;
+    ip->prev = &ifreelist;
+    ifreelist.next->prev = ip;
+    ifreelist.next = ip;
+  }
+}
+
 // find the inode with number inum and return the in-memory copy.  does not lock the inode and does not read it from disk
 struct inode *iget(uint inum)
 {
-  struct inode *ip, *empty; int e = splhi();
+  struct inode *ip, **pp; int e = splhi();
 
   // is the inode already cached
-  empty = 0;
-  for (ip = &inode[0]; ip < &inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->inum == inum) {
-      ip->ref++;
+  for (ip = ihash[inum & (NIHASH-1)]; ip; ip = ip->hnext) {
+    if (ip->inum == inum) {
+      if (!ip->ref++) { ip->prev->next = ip->next; ip->next->prev = ip->prev; }
       splx(e);
       return ip;
     }
-    if (!empty && !ip->ref) empty = ip; // remember empty slot
   }
 
-  // recycle an inode cache entry
-  if (!empty) panic("iget: no inodes");
+  // recycle the least recently used inode cache entry
+  if ((ip = ifreelist.prev) == &ifreelist) panic("iget: no inodes");
+  ip->prev->next = ip->next; ip->next->prev = ip->prev;
+  if (ip->inum) {
+    for (pp = &ihash[ip->inum & (NIHASH-1)]; *pp != ip; pp = &(*pp)->hnext) ;
+    *pp = ip->hnext;
+  }
+  ip->hnext = ihash[inum & (NIHASH-1)];
+  ihash[inum & (NIHASH-1)] = ip;
 
-  ip = empty;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->last = inum; // data goes after the inode
+  ip->leaf = 0;
   splx(e);
   
   return ip;
@@ -572,7 +773,7 @@ struct inode *ialloc(ushort mode)
   struct buf *bp;
   struct dinode *dip;
 
-  inum = balloc();
+  inum = balloc(0);
   bp = bread(inum);
   dip = (struct dinode *)bp->data;
   memset(dip, 0, sizeof(*dip));
@@ -593,9 +794,9 @@ iupdate(struct inode *ip)
   dip->mode  = ip->mode;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-//  printf("iupdate() memcpy(dip->dir, ip->dir, %d)\n",sizeof(ip->dir));
-  memcpy(dip->dir, ip->dir, sizeof(ip->dir));
-  memcpy(dip->idir, ip->idir, sizeof(ip->idir));
+  dip->flags = ip->dflags;
+  if (ip->map) memcpy(dip->dir, ip->map, sizeof(struct imap)); // else the disk copy is current
+  else if ((ip->mode & S_IFMT) == S_IFCHR || (ip->mode & S_IFMT) == S_IFBLK) { dip->dir[0] = ip->major; dip->dir[1] = ip->minor; }
   bwrite(bp);
   brelse(bp);
 }
@@ -611,7 +812,6 @@ idup(struct inode *ip)
 // lock the given inode.  read the inode from disk if necessary
 ilock(struct inode *ip)
 {
-  struct buf *bp;
   struct dinode *dip;
   int e = splhi();
 
@@ -622,14 +822,14 @@ ilock(struct inode *ip)
   splx(e);
   
   if (!(ip->flags & I_VALID)) {
-    bp = bread(ip->inum);
-    dip = (struct dinode *)bp->data;
+    dip = (struct dinode *)idepeek(ip->inum);
     ip->mode  = dip->mode;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memcpy(ip->dir,  dip->dir,  sizeof(ip->dir));
-    memcpy(ip->idir, dip->idir, sizeof(ip->idir));
-    brelse(bp);
+    ip->dflags = dip->flags & ~D_FREESUM;
+    ip->major = dip->dir[0];
+    ip->minor = dip->dir[1];
+    ip->mod = 0;
     ip->flags |= I_VALID;
     if (!ip->mode) panic("ilock: no mode");
   }
@@ -659,13 +859,20 @@ iput(struct inode *ip)
     ip->flags |= I_BUSY;
     splx(e);
     itrunc(ip);
+    if ((ip->mode & S_IFMT) == S_IFDIR) dcpurge(ip->inum);
     ip->mode = 0;
     bfree(ip->inum); 
     e = splhi();
     ip->flags = 0;
     wakeup(ip);
   }
-  ip->ref--;
+  if (!--ip->ref) { // stays cached, most recently used
+    if (ip->map) { kfree(ip->map); ip->map = 0; }
+    ip->next = ifreelist.next;
+    ip->prev = &ifreelist;
+    ifreelist.next->prev = ip;
+    ifreelist.next = ip;
+  }
   splx(e);
 }
 
@@ -678,62 +885,144 @@ iunlockput(struct inode *ip)
 
 // Inode contents:
 // The contents (data) associated with each inode is stored in a sequence of blocks on the disk.
-// The first NDIR blocks are listed in ip->dir[].  The next NIDIR blocks are listed in the block ip->idir[].
+// The first NDIR blocks are listed in dir[].  The next NIDIR*1024 blocks are listed in the single indirect
+// blocks idir[], then come the double indirect blocks iidir[] and the triple indirect iiidir[], all in ip->map.
+// The single indirect block last used is remembered in the inode so sequential access skips the upper levels.
+
+// return the block addresses of a locked inode, loading them if necessary
+struct imap *imap(struct inode *ip)
+{
+  if (!ip->map) ip->map = memcpy(kalloc(), ((struct dinode *)idepeek(ip->inum))->dir, sizeof(struct imap));
+  return ip->map;
+}
+
+// return the block listed at a[i], allocating (and zeroing) it if necessary
+uint bslot(struct inode *ip, uint *a, uint i)
+{
+  if (!a[i]) {
+    a[i] = ip->last = balloc(ip->last);
+    bzero(a[i]);
+  }
+  return a[i];
+}
+
+// return the single indirect block for block bn (counted past the direct blocks) in an indirect tree
+uint bleaf(struct inode *ip, uint bn)
+{
+  uint addr, level, i; struct buf *bp; struct imap *m = ip->map;
+
+  if (bn < NIDIR * 1024) return bslot(ip, m->idir, bn / 1024);
+  if ((bn -= NIDIR * 1024) < NIIDIR * 1024 * 1024) { addr = bslot(ip, m->iidir, bn >> 20); level = 1; }
+  else { bn -= NIIDIR * 1024 * 1024; addr = bslot(ip, m->iiidir, bn >> 30); level = 2; }
+  for (; level; level--) {
+    bp = bread(addr);
+    i = (bn >> (10 * level)) & 1023;
+    if (!((uint *)bp->data)[i]) { addr = bslot(ip, (uint *)bp->data, i); bwrite(bp); }
+    else addr = ((uint *)bp->data)[i];
+    brelse(bp);
+  }
+  return addr;
+}
+
+// Extent mapped inodes keep up to NDIR/2 runs of contiguous blocks in dir[].  Return the address of block bn and
+// in *run how many blocks follow it contiguously.  The block past the end is allocated, extending the last run when
+// possible.  Returns 0 if a new run is needed and there is no room for it.
+uint emap(struct inode *ip, uint bn, uint *run)
+{
+  uint i, addr; struct imap *m = imap(ip);
+
+  for (i = 0; i < NDIR && m->dir[i+1]; i += 2) {
+    if (bn < m->dir[i+1]) {
+      if (run) *run = m->dir[i+1] - bn;
+      return m->dir[i] + bn;
+    }
+    bn -= m->dir[i+1];
+  }
+  if (bn) panic("emap: hole");
+  addr = balloc(i ? m->dir[i-2] + m->dir[i-1] - 1 : ip->last);
+  if (i && addr == m->dir[i-2] + m->dir[i-1]) m->dir[i-1]++;
+  else if (i == NDIR) { bfree(addr); return 0; }
+  else { m->dir[i] = addr; m->dir[i+1] = 1; }
+  ip->last = addr;
+  if (run) *run = 1;
+  return addr;
+}
+
 // Return the disk block address of the nth block in inode ip. If there is no such block, bmap allocates one.
 uint bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
+  struct imap *m;
 
+  if (ip->dflags & D_EXTENT) return emap(ip, bn, 0);
+  m = imap(ip);
   if (bn < NDIR) {
-    if (!(addr = ip->dir[bn])) ip->dir[bn] = addr = balloc();
+    if (!(addr = m->dir[bn])) m->dir[bn] = ip->last = addr = balloc(ip->last);
     return addr;
   }
   bn -= NDIR;
-  if (bn >= NIDIR * 1024) panic("bmap: out of range");
 
-  // load indirect block, allocating if necessary
-  if (!(addr = ip->idir[bn / 1024])) ip->idir[bn / 1024] = addr = balloc();
+  // load single indirect block, allocating if necessary
+  if (ip->leaf == bn / 1024 + 1) addr = ip->leafaddr;
+  else {
+    ip->leafaddr = addr = bleaf(ip, bn);
+    ip->leaf = bn / 1024 + 1;
+  }
   bp = bread(addr);
   a = (uint *)bp->data;
   if (!(addr = a[bn & 1023])) {
-    a[bn & 1023] = addr = balloc();
+    a[bn & 1023] = ip->last = addr = balloc(ip->last);
     bwrite(bp);
   }
   brelse(bp);
   return addr;
 }
 
+// free an indirect block and everything below it
+ifree(uint addr, int level)
+{
+  int i;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(addr);
+  a = (uint *)bp->data;
+  for (i = 0; i < 1024; i++) {
+    if (!a[i]) break;
+    if (level > 1) ifree(a[i], level - 1); else bfree(a[i]);
+  }
+  brelse(bp);
+  bfree(addr);
+}
+
 // truncate inode (discard contents)
 // only called when the inode has no links to it (no directory entries referring to it)
 // and has no in-memory reference to it (is not an open file or current directory)
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i, j; struct imap *m = imap(ip);
 
-  for (i = 0; i < NDIR; i++) {
-    if (!ip->dir[i]) goto done;  // XXX done by ip->size?
-    bfree(ip->dir[i]);
-    ip->dir[i] = 0;
-  }
-  
-  for (i = 0; i < NIDIR; i++) {
-    if (!ip->idir[i]) break;
-    bp = bread(ip->idir[i]);
-    a = (uint *)bp->data;
-    for (j = 0; j < 1024; j++) {
-      if (!a[j]) break;
-      bfree(a[j]);
+  ip->leaf = 0;
+  if (ip->dflags & D_EXTENT) {
+    for (i = 0; i < NDIR && m->dir[i+1]; i += 2) {
+      for (j = 0; j < m->dir[i+1]; j++) bfree(m->dir[i] + j);
+      m->dir[i] = m->dir[i+1] = 0;
     }
-    brelse(bp);
-    bfree(ip->idir[i]);
-    ip->idir[i] = 0;
+    goto done;
+  }
+  for (i = 0; i < NDIR; i++) {
+    if (!m->dir[i]) goto done;  // XXX done by ip->size?
+    bfree(m->dir[i]);
+    m->dir[i] = 0;
   }
+  for (i = 0; i < NIDIR && m->idir[i]; i++) { ifree(m->idir[i], 1); m->idir[i] = 0; }
+  for (i = 0; i < NIIDIR && m->iidir[i]; i++) { ifree(m->iidir[i], 2); m->iidir[i] = 0; }
+  for (i = 0; i < NIIIDIR && m->iiidir[i]; i++) { ifree(m->iiidir[i], 3); m->iiidir[i] = 0; }
 
 done:
   ip->size = 0;
+  ip->mod = 0;
   iupdate(ip);
 }
 
@@ -750,20 +1039,25 @@ stati(struct inode *ip, struct stat *st)
 // read data from inode
 int readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, run;
   struct buf *bp;
 
   if ((ip->mode & S_IFMT) == S_IFCHR) { // S_IFBLK ??
-//    if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read) return -1;
-//    return devsw[ip->major].read(ip, dst, n);
-    if (ip->dir[0] >= NDEV || !devsw[ip->dir[0]].read) return -1; // XXX refactor
-    return devsw[ip->dir[0]].read(ip, dst, n);
+    if (ip->major >= NDEV || !devsw[ip->major].read) return -1;
+    return devsw[ip->major].read(ip, dst, n);
   }
 
   if (off > ip->size || off + n < off) return -1;
   if (off + n > ip->size) n = ip->size - off;
 
   for (tot = n; tot; tot -= m, off += m, dst += m) {
+    if ((ip->dflags & D_EXTENT) && !(off % PAGE) && tot >= PAGE) { // whole blocks of a run in one request
+      addr = emap(ip, off/PAGE, &run);
+      if (run > tot/PAGE) run = tot/PAGE;
+      idebulk(addr, dst, run);
+      m = run*PAGE;
+      continue;
+    }
     bp = bread(bmap(ip, off/PAGE));
     if ((m = PAGE - off%PAGE) > tot) m = tot;
     memcpy(dst, bp->data + off%PAGE, m);
@@ -775,30 +1069,29 @@ int readi(struct inode *ip, char *dst, uint off, uint n)
 // write data to inode
 int writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if ((ip->mode & S_IFMT) == S_IFCHR) { // XXX S_IFBLK ??
-//    if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write) return -1;
-//    return devsw[ip->major].write(ip, src, n);
-    if (ip->dir[0] >= NDEV || !devsw[ip->dir[0]].write) return -1; // XXX refactor
-    return devsw[ip->dir[0]].write(ip, src, n);
+    if (ip->major >= NDEV || !devsw[ip->major].write) return -1;
+    return devsw[ip->major].write(ip, src, n);
   }
   if (off > ip->size || off + n < off) return -1;
-  if (off + n > (NDIR + NIDIR*1024)*PAGE) return -1;
 
   for (tot = n; tot; tot -= m, off += m, src += m) {
-    bp = bread(bmap(ip, off/PAGE));
+    if (!(addr = bmap(ip, off/PAGE))) break; // too fragmented
+    bp = bread(addr);
     if ((m = PAGE - off%PAGE) > tot) m = tot;
     memcpy(bp->data + off%PAGE, src, m);
     bwrite(bp);
     brelse(bp);
   }
+  if (n > 0) ip->mod = 0;
   if (n > 0 && off > ip->size) {
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return n - tot;
 }
 
 // directories:
@@ -809,20 +1102,263 @@ int namecmp(char *p, char *q)
   return 0;
 }
 
+// name cache:
+// Remembers what dirlookup() found, including names that are not there.  Callers hold the directory locked, so
+// an entry stays true until dirlink() or unlink() changes the directory, and both keep the cache in step.  Entries
+// for a directory are purged when its inode is freed.  Long names are not cached.
+
+// return the hash chain for a name, or 0 if it is too long to cache
+struct dcache **dcslot(uint dp, char *name)
+{
+  uint h = dp; int n;
+  for (n = 0; n < DCNAME && name[n]; n++) h = h * 31 + name[n];
+  return (n < DCNAME) ? &dchash[h & (NDHASH-1)] : 0;
+}
+
+struct dcache *dcfind(uint dp, char *name)
+{
+  struct dcache **hp, *d;
+  if (!(hp = dcslot(dp, name))) return 0;
+  for (d = *hp; d; d = d->next) if (d->dp == dp && !namecmp(name, d->name)) return d;
+  return 0;
+}
+
+dcdrop(struct dcache *d)
+{
+  struct dcache **pp;
+  for (pp = dcslot(d->dp, d->name); *pp != d; pp = &(*pp)->next) ;
+  *pp = d->next;
+  d->dp = 0;
+}
+
+// record what a name in directory dp refers to, recycling entries second chance style
+dcenter(uint dp, char *name, uint ino, uint off)
+{
+  struct dcache **hp, *d; int i;
+
+  if (!(hp = dcslot(dp, name))) return;
+  if (!(d = dcfind(dp, name))) {
+    for (;;) {
+      d = &dcache[dchand++ & (NDCACHE-1)];
+      if (!d->dp) break;
+      if (!d->used) { dcdrop(d); break; }
+      d->used = 0;
+    }
+    d->dp = dp;
+    for (i = 0; d->name[i] = name[i]; i++) ;
+    d->next = *hp;
+    *hp = d;
+  }
+  d->ino = ino;
+  d->off = off;
+  d->used = 1;
+}
+
+// forget everything cached for a directory
+dcpurge(uint dp)
+{
+  struct dcache *d;
+  for (d = dcache; d < &dcache[NDCACHE]; d++) if (d->dp == dp) dcdrop(d);
+}
+
+// indexed directories:
+uint dirhash(char *name)
+{
+  uint h = 5381; int n;
+  for (n = 0; n < DIRSIZ && name[n]; n++) h = (h * 33) ^ (name[n] & 0xff);
+  return h;
+}
+
+// return the leaf block holding name, and its number within the directory in *lb
+struct buf *dirleaf(struct inode *dp, char *name, uint *lb)
+{
+  struct buf *bp; struct dindex *x; uint b;
+
+  bp = bread(bmap(dp, 0));
+  x = (struct dindex *)bp->data;
+  b = x->blk[dirhash(name) & ((1 << x->depth) - 1)];
+  brelse(bp);
+  if (lb) *lb = b;
+  return bread(bmap(dp, b));
+}
+
+struct dent *dentfind(struct dleaf *l, char *name)
+{
+  char *p; struct dent *e;
+  for (p = l->data; p < l->data + l->used; p += e->len) {
+    e = (struct dent *)p;
+    if (!namecmp(name, e->name)) return e;
+  }
+  return 0;
+}
+
+uint hdirlookup(struct inode *dp, char *name)
+{
+  struct buf *bp; struct dent *e; uint ino;
+
+  bp = dirleaf(dp, name, 0);
+  ino = (e = dentfind((struct dleaf *)bp->data, name)) ? e->ino : 0;
+  brelse(bp);
+  return ino;
+}
+
+// add an entry, splitting its leaf (and doubling the index) until it fits.  fails when the index can grow no more
+int hdirlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *bp, *xp, *np; struct dleaf *l, *nl; struct dindex *x; struct dent *e;
+  uint lb, nb, d, i, n, m; char *p, *q, *end;
+
+  for (n = 0; n < DIRSIZ && name[n]; n++) ;
+  m = (n + 12) & -4;
+  for (;;) {
+    bp = dirleaf(dp, name, &lb);
+    l = (struct dleaf *)bp->data;
+    if (l->used + m <= PAGE - 4) {
+      e = (struct dent *)(l->data + l->used);
+      e->ino = inum;
+      e->len = m;
+      e->nlen = n;
+      memcpy(e->name, name, n);
+      e->name[n] = 0;
+      l->used += m;
+      bwrite(bp);
+      brelse(bp);
+      return 0;
+    }
+    d = l->depth;
+    brelse(bp);
+
+    xp = bread(bmap(dp, 0));
+    x = (struct dindex *)xp->data;
+    if (d == x->depth) {
+      if (d == DMAXDEPTH) { brelse(xp); return -1; }
+      for (i = 0; i < 1 << d; i++) x->blk[i + (1 << d)] = x->blk[i];
+      x->depth++;
+    }
+    nb = dp->size / PAGE;
+    np = bread(bmap(dp, nb));
+    dp->size += PAGE;
+    iupdate(dp);
+    bp = bread(bmap(dp, lb));
+    l = (struct dleaf *)bp->data;
+    nl = (struct dleaf *)np->data;
+    l->depth = nl->depth = d + 1;
+    nl->used = 0;
+    end = l->data + l->used;
+    for (p = q = l->data; p < end; p += m) { // names with hash bit d set move to the new leaf
+      e = (struct dent *)p;
+      m = e->len;
+      if ((dirhash(e->name) >> d) & 1) { memcpy(nl->data + nl->used, p, m); nl->used += m; }
+      else for (i = 0; i < m; i++) *q++ = p[i];
+    }
+    l->used = q - l->data;
+    for (i = 0; i < 1 << x->depth; i++) if (x->blk[i] == lb && ((i >> d) & 1)) x->blk[i] = nb;
+    bwrite(np); brelse(np);
+    bwrite(bp); brelse(bp);
+    bwrite(xp); brelse(xp);
+    m = (n + 12) & -4;
+  }
+}
+
+hdirunlink(struct inode *dp, char *name)
+{
+  struct buf *bp; struct dleaf *l; struct dent *e; char *p, *q, *end;
+
+  bp = dirleaf(dp, name, 0);
+  l = (struct dleaf *)bp->data;
+  if (!(e = dentfind(l, name))) panic("hdirunlink");
+  end = l->data + l->used;
+  l->used -= e->len;
+  for (p = (char *)e, q = p + e->len; q < end; ) *p++ = *q++;
+  bwrite(bp);
+  brelse(bp);
+}
+
+int hdirempty(struct inode *dp)
+{
+  struct buf *bp; struct dleaf *l; struct dent *e; char *p; uint b;
+
+  for (b = 1; b < dp->size / PAGE; b++) {
+    bp = bread(bmap(dp, b));
+    l = (struct dleaf *)bp->data;
+    for (p = l->data; p < l->data + l->used; p += e->len) {
+      e = (struct dent *)p;
+      if (namecmp(e->name, ".") && namecmp(e->name, "..")) { brelse(bp); return 0; }
+    }
+    brelse(bp);
+  }
+  return 1;
+}
+
+// read entries as struct direct records.  *poff is a cookie: leaf block * PAGE + offset within its entries
+int hdirread(struct inode *dp, char *dst, uint *poff, uint n)
+{
+  struct buf *bp; struct dleaf *l; struct dent *e; uint off, b, pos, r;
+
+  if ((off = *poff) < PAGE) off = PAGE;
+  for (r = 0; r + sizeof(struct direct) <= n && (b = off / PAGE) < dp->size / PAGE; ) {
+    bp = bread(bmap(dp, b));
+    l = (struct dleaf *)bp->data;
+    for (pos = off % PAGE; pos < l->used && r + sizeof(struct direct) <= n; pos += e->len) {
+      e = (struct dent *)(l->data + pos);
+      *(uint *)(dst + r) = e->ino;
+      xstrncpy(dst + r + 4, e->name, DIRSIZ);
+      r += sizeof(struct direct);
+    }
+    off = (pos < l->used) ? b * PAGE + pos : (b + 1) * PAGE;
+    brelse(bp);
+  }
+  *poff = off;
+  return r;
+}
+
+// turn a flat directory that has filled its first block into an indexed one
+dirindex(struct inode *dp)
+{
+  struct buf *bp; struct direct *de, *p;
+
+  de = (struct direct *)kalloc();
+  if (readi(dp, (char *)de, 0, PAGE) != PAGE) panic("dirindex read");
+  itrunc(dp);
+  dp->dflags |= D_INDEX;
+  bp = bread(bmap(dp, 0));
+  memset(bp->data, 0, PAGE);
+  ((struct dindex *)bp->data)->blk[0] = 1;
+  bwrite(bp);
+  brelse(bp);
+  bp = bread(bmap(dp, 1));
+  memset(bp->data, 0, PAGE);
+  bwrite(bp);
+  brelse(bp);
+  dp->size = 2 * PAGE;
+  iupdate(dp);
+  for (p = de; p < de + PAGE / sizeof(struct direct); p++)
+    if (p->d_ino && hdirlink(dp, p->d_name, p->d_ino)) panic("dirindex");
+  kfree((char *)de);
+}
+
 // look for a directory entry in a directory. If found, set *poff to byte offset of entry.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off; struct direct de;
+  uint off, ino; struct direct de; struct dcache *d;
 
   if ((dp->mode & S_IFMT) != S_IFDIR) panic("dirlookup not DIR");
-  for (off = 0; off < dp->size; off += sizeof(de)) {
+  if (d = dcfind(dp->inum, name)) {
+    d->used = 1;
+    if (!d->ino) return 0;
+    if (poff) *poff = d->off;
+    return iget(d->ino);
+  }
+  ino = off = 0;
+  if (dp->dflags & D_INDEX) ino = hdirlookup(dp, name);
+  else for (; off < dp->size; off += sizeof(de)) {
     if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink read");
-    if (de.d_ino && !namecmp(name, de.d_name)) { // entry matches path element
-      if (poff) *poff = off;
-      return iget(de.d_ino);
-    }
+    if (de.d_ino && !namecmp(name, de.d_name)) { ino = de.d_ino; break; } // entry matches path element
   }
-  return 0;
+  dcenter(dp->inum, name, ino, off);
+  if (!ino) return 0;
+  if (poff) *poff = off;
+  return iget(ino);
 }
 
 // write a new directory entry (name, inum) into the directory dp
@@ -837,24 +1373,46 @@ int dirlink(struct inode *dp, char *name, uint inum)
     iput(ip);
     return -1;
   }
-  // look for an empty direct
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink read");
-    if (!de.d_ino) break;
+  if (!(dp->dflags & D_INDEX)) {
+    // look for an empty direct
+    for (off = 0; off < dp->size; off += sizeof(de)) {
+      if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink read");
+      if (!de.d_ino) break;
+    }
+    if (off < PAGE || dp->size != PAGE) {
+      xstrncpy(de.d_name, name, DIRSIZ);
+      de.d_ino = inum;
+      if (writei(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink");
+      dcenter(dp->inum, name, inum, off);
+      return 0;
+    }
+    dirindex(dp);
   }
-  xstrncpy(de.d_name, name, DIRSIZ);
-  de.d_ino = inum;
-  if (writei(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("dirlink");
-  
+  if (hdirlink(dp, name, inum)) return -1;
+  dcenter(dp->inum, name, inum, 0);
   return 0;
 }
 
+// remove the entry for name found by dirlookup() at off
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct direct de;
+
+  if (dp->dflags & D_INDEX) hdirunlink(dp, name);
+  else {
+    memset(&de, 0, sizeof(de));
+    if (writei(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("unlink: writei");
+  }
+  dcenter(dp->inum, name, 0, 0);
+}
+
 // is the directory dp empty except for "." and ".." ?
 int isdirempty(struct inode *dp)
 {
   int off;
   struct direct de;
 
+  if (dp->dflags & D_INDEX) return hdirempty(dp);
   for (off=2*sizeof(de); off<dp->size; off+=sizeof(de)) {
     if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("isdirempty: readi");
     if (de.d_ino) return 0;
@@ -1054,8 +1612,8 @@ struct inode *create(char *path, ushort mode, int dev)
 
   ilock(ip);
   if ((mode & S_IFMT) == S_IFCHR || (ip->mode & S_IFMT) == S_IFBLK) {
-    ip->dir[0] = (dev >> 8) & 0xff;
-    ip->dir[1] = dev & 0xff;
+    ip->major = (dev >> 8) & 0xff;
+    ip->minor = dev & 0xff;
   }
   ip->nlink = 1;
   iupdate(ip);
@@ -1067,7 +1625,14 @@ struct inode *create(char *path, ushort mode, int dev)
     if (dirlink(ip, ".", ip->inum) || dirlink(ip, "..", dp->inum)) panic("create dots");
   }
 
-  if (dirlink(dp, name, ip->inum)) panic("create: dirlink");
+  if (dirlink(dp, name, ip->inum)) { // directory index is full
+    if ((mode & S_IFMT) == S_IFDIR) { dp->nlink--; iupdate(dp); }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
   return ip;
@@ -1084,7 +1649,6 @@ int sockconnect(int fd, uint family_port, uint addr) { asm(LL, 8); asm(LBL,16);
 int sockread (int sd, char *addr, int n) { asm(LL,8); asm(LBL,16); asm(LCL,24); asm(NET4); }
 int sockwrite(int sd, char *addr, int n) { asm(LL,8); asm(LBL,16); asm(LCL,24); asm(NET5); }
 int sockpoll(int sd) { asm(LL, 8); asm(NET6); }
-enum { M_OPEN, M_CLOSE, M_READ, M_WRITE, M_SEEK, M_FSTAT, M_SYNC };
 
 int socktx(int sd, void *p, int n)
 {
@@ -1112,6 +1676,276 @@ int sockrx(int sd, void *p, int n) // XXX this is always going to be slow until
   return 0;
 }
 
+uint htonl(uint a) { return (a >> 24) | ((a >> 8) & 0xff00) | ((a << 8) & 0xff0000) | (a << 24); } // XXX eliminate
+ushort htons(ushort a) { return (a >> 8) | (a << 8); } // XXX eliminate
+
+// remote file system:
+// Files under "rfs/" live on a file server (fsd) reached over one shared connection.  Each request is five
+// ints {op, id, fh, off, n} followed by n bytes of path or data, each reply is three ints {id, r, n} followed
+// by n bytes of data or attributes.  Replies come back in order but nobody waits on the socket for a particular
+// one: whichever process needs a reply reads them all until its own arrives, dropping data straight into the
+// cache blocks that asked for it.  That lets read-ahead and writes stay in flight without anyone blocking on them.
+//
+// Blocks are cached per rnode (one per remote path) for as long as the rnode's attribute lease holds.  When it
+// expires the attributes are fetched again and the blocks are dropped if the size or modification time changed.
+// Writes go straight through to the server and patch any cached copy on the way.
+
+int rfsconnect()
+{
+  if (rfsd >= 0) return 0;
+  if ((rfsd = sockopen(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  if (sockconnect(rfsd, AF_INET | (htons(5003) << 16), htonl(0x7f000001))) { sockclose(rfsd); rfsd = -1; return -1; }
+  return 0;
+}
+
+// drop the connection, failing everything still in flight
+rfsfail()
+{
+  struct rreq *q; struct rbuf *b;
+
+  if (rfsd >= 0) { sockclose(rfsd); rfsd = -1; }
+  for (q = rreq; q < &rreq[NRREQ]; q++) {
+    if (!q->id) continue;
+    q->r = -1;
+    if (q->discard) q->id = 0; else q->done = 1;
+  }
+  for (b = rbuf; b < &rbuf[NRBUF]; b++) if (b->state == RB_BUSY && b->rn) b->state = RB_EMPTY;
+  wakeup(rreq);
+}
+
+// read one reply and hand it to its request
+rfsrecv()
+{
+  int h[3]; struct rreq *q; struct rbuf *b;
+
+  if (sockrx(rfsd, h, 12)) { rfsfail(); return; }
+  q = &rreq[h[0] & (NRREQ-1)];
+  if (!h[0] || q->id != h[0]) { printf("rfsrecv() bad id\n"); rfsfail(); return; }
+  q->r = h[1];
+  if (b = q->b) {
+    if ((uint)h[2] > PAGE || (h[2] && sockrx(rfsd, b->data, h[2]))) { rfsfail(); return; }
+    b->len = (q->r > 0) ? h[2] : 0;
+    if (b->rn && b->state == RB_BUSY) b->state = b->stale ? RB_EMPTY : RB_VALID;
+  } else if ((uint)h[2] > sizeof(struct rattr) || (h[2] && sockrx(rfsd, &q->a, h[2]))) { rfsfail(); return; }
+  if (q->discard) q->id = 0; else q->done = 1;
+  wakeup(rreq);
+}
+
+// make progress on replies, or sleep while another process does
+rfspump()
+{
+  if (rfsd < 0) return;
+  if (rfsreading) { sleep(rreq); return; }
+  rfsreading = 1;
+  rfsrecv();
+  rfsreading = 0;
+  wakeup(rreq);
+}
+
+// send a request, returns its slot or 0 if the server is gone.  a discarded request frees itself on reply
+struct rreq *rfssend(int op, int fh, int off, int n, char *p, struct rbuf *b, int discard)
+{
+  int i, h[5]; struct rreq *q;
+
+  for (;;) {
+    if (rfsd < 0) return 0;
+    for (i = 0; i < NRREQ && rreq[i].id; i++) ;
+    if (i < NRREQ) break;
+    rfspump();
+  }
+  q = &rreq[i];
+  if (!(rfsid = (rfsid + NRREQ) & 0x7fffffff)) rfsid = NRREQ;
+  q->id = rfsid | i;
+  q->r = -1;
+  q->done = 0;
+  q->discard = discard;
+  q->b = b;
+  h[0] = op; h[1] = q->id; h[2] = fh; h[3] = off; h[4] = n;
+  if (socktx(rfsd, h, 20) || (p && n > 0 && socktx(rfsd, p, n))) { q->discard = 1; rfsfail(); return 0; }
+  return q;
+}
+
+// wait for the reply to a request and free its slot
+int rfswait(struct rreq *q)
+{
+  while (!q->done) rfspump();
+  q->id = 0;
+  return q->r;
+}
+
+// install fresh attributes, dropping cached blocks if the file changed underneath us
+// (or might have: a server that sends no mtime can't show a same size rewrite)
+rfsnew(struct rnode *rn, struct rattr *a)
+{
+  struct rbuf *b;
+  if (a->st.st_size != rn->a.st.st_size || a->mtime != rn->a.mtime || !a->mtime) {
+    for (b = rbuf; b < &rbuf[NRBUF]; b++) {
+      if (b->rn != rn) continue;
+      if (b->state == RB_BUSY) b->stale = 1; else b->state = RB_EMPTY;
+    }
+  }
+  memcpy(&rn->a, a, sizeof(struct rattr));
+  rn->lease = ticks + RLEASE;
+}
+
+// refresh the attributes once the lease has run out
+int rfsattr(struct file *f)
+{
+  struct rreq *q;
+  if ((int)(f->rn->lease - ticks) > 0) return 0;
+  if (!(q = rfssend(M_FSTAT, f->fh, 0, 0, 0, 0, 0)) || rfswait(q) < 0) return -1;
+  rfsnew(f->rn, &q->a);
+  return 0;
+}
+
+// find a cached block, or claim the least recently used idle one
+struct rbuf *rfsget(struct rnode *rn, uint blk)
+{
+  struct rbuf *b, *v;
+
+  for (;;) {
+    v = 0;
+    for (b = rbuf; b < &rbuf[NRBUF]; b++) {
+      if (rn && b->rn == rn && b->blk == blk && b->state != RB_EMPTY) return b;
+      if (b->state != RB_BUSY && (!v || b->used < v->used)) v = b;
+    }
+    if (v) break;
+    if (rfsd < 0) return 0;
+    rfspump();
+  }
+  if (!v->data) v->data = kalloc();
+  v->rn = rn;
+  v->blk = blk;
+  v->state = RB_EMPTY;
+  v->len = 0;
+  return v;
+}
+
+// start reading a block unless it is cached or already on its way
+struct rbuf *rfsstart(struct file *f, uint blk)
+{
+  struct rbuf *b;
+
+  if (!(b = rfsget(f->rn, blk))) return 0;
+  if (b->state == RB_EMPTY) {
+    b->state = RB_BUSY;
+    b->stale = 0;
+    if (!rfssend(M_READ, f->fh, blk * PAGE, PAGE, 0, b, 1)) { b->state = RB_EMPTY; return 0; }
+  }
+  b->used = ++rfsclock;
+  return b;
+}
+
+// return a valid block, reading ahead of it if access is sequential
+struct rbuf *rfsblock(struct file *f, uint blk, int seq)
+{
+  struct rbuf *b; uint i;
+
+  for (;;) {
+    if (!(b = rfsstart(f, blk))) return 0;
+    for (i = 1; seq && i <= RAHEAD && (blk + i) * PAGE < f->rn->a.st.st_size; i++) rfsstart(f, blk + i);
+    while (b->state == RB_BUSY && rfsd >= 0) rfspump();
+    if (b->state == RB_VALID && b->rn == f->rn && b->blk == blk) return b;
+    if (rfsd < 0) return 0;
+  }
+}
+
+// directories are read straight through a bounce block, the server decides what a record is
+int rfsdir(struct file *f, char *addr, int n)
+{
+  int r; struct rbuf *b; struct rreq *q;
+
+  if (n > PAGE) n = PAGE;
+  if (!(b = rfsget(0, 0))) return -1;
+  b->state = RB_BUSY;
+  if (!(q = rfssend(M_READ, f->fh, f->off, n, 0, b, 0)) || (r = rfswait(q)) < 0) r = -1;
+  else if ((r = b->len) > 0) { memcpy(addr, b->data, r); f->off += r; }
+  b->state = RB_EMPTY;
+  return r;
+}
+
+int rfsread(struct file *f, char *addr, int n)
+{
+  int i, m; uint off; struct rnode *rn = f->rn; struct rbuf *b;
+
+  if ((rn->a.st.st_mode & S_IFMT) == S_IFDIR) return rfsdir(f, addr, n);
+  if (rfsattr(f)) return -1;
+  if (f->off >= rn->a.st.st_size) return 0;
+  if (n > rn->a.st.st_size - f->off) n = rn->a.st.st_size - f->off;
+  for (m = 0; m < n; m += i) {
+    off = f->off;
+    if (!(b = rfsblock(f, off / PAGE, off == rn->next || !off))) return m ? m : -1;
+    if ((i = b->len - off % PAGE) <= 0) break;
+    if (i > n - m) i = n - m;
+    memcpy(addr + m, b->data + off % PAGE, i);
+    f->off += i;
+    rn->next = f->off;
+  }
+  return m;
+}
+
+int rfswrite(struct file *f, char *addr, int n)
+{
+  uint off, s, e; struct rnode *rn = f->rn; struct rbuf *b;
+
+  off = f->off;
+  if (n > 0 && !rfssend(M_WRITE, f->fh, off, n, addr, 0, 1)) return -1;
+  for (b = rbuf; b < &rbuf[NRBUF]; b++) { // keep cached copies in step with what was just sent
+    if (b->rn != rn || b->state == RB_EMPTY || (b->blk + 1) * PAGE <= off || b->blk * PAGE >= off + n) continue;
+    if (b->state == RB_BUSY) { b->stale = 1; continue; }
+    s = (off > b->blk * PAGE) ? off - b->blk * PAGE : 0;
+    if (s > b->len) { b->state = RB_EMPTY; continue; } // would leave a hole
+    if ((e = off + n - b->blk * PAGE) > PAGE) e = PAGE;
+    memcpy(b->data + s, addr + b->blk * PAGE + s - off, e - s);
+    if (e > b->len) b->len = e;
+  }
+  f->off += n;
+  if (f->off > rn->a.st.st_size) rn->a.st.st_size = f->off;
+  return n;
+}
+
+int rfsopen(char *path, int oflag)
+{
+  int fd, n; struct file *f; struct rnode *rn, *v; struct rreq *q; struct rbuf *b;
+
+  if ((n = strlen(path) + 1) > RPATH || rfsconnect()) return -1;
+  if (!(f = filealloc()) || (fd = fdalloc(f)) < 0) {
+    if (f) fileclose(f);
+    return -1;
+  }
+  if (!(q = rfssend(M_OPEN, 0, oflag, n, path, 0, 0)) || (f->fh = rfswait(q)) < 0) { u->ofile[fd] = 0; fileclose(f); return -1; }
+
+  v = 0;
+  for (rn = rnode; rn < &rnode[NRNODE]; rn++) {
+    if (!memcmp(rn->path, path, n)) break;
+    if (!rn->ref && (!v || v->path[0])) v = rn;
+  }
+  if (rn == &rnode[NRNODE]) {
+    if (!(rn = v)) { rfssend(M_CLOSE, f->fh, 0, 0, 0, 0, 1); u->ofile[fd] = 0; fileclose(f); return -1; }
+    for (b = rbuf; b < &rbuf[NRBUF]; b++) {
+      if (b->rn != rn) continue;
+      if (b->state == RB_BUSY) b->stale = 1; else b->state = RB_EMPTY;
+    }
+    memcpy(rn->path, path, n);
+    rn->next = 0;
+  }
+  rn->ref++;
+  rfsnew(rn, &q->a);
+
+  f->type = FD_RFS;
+  f->rn = rn;
+  f->off = 0;
+  f->readable = !(oflag & O_WRONLY);
+  f->writable = (oflag & O_WRONLY) || (oflag & O_RDWR);
+  return fd;
+}
+
+rfsclose(struct file *f)
+{
+  rfssend(M_CLOSE, f->fh, 0, 0, 0, 0, 1);
+  f->rn->ref--;
+}
+
 fileclose(struct file *f)
 {
   struct file ff; int e = splhi();
@@ -1129,8 +1963,8 @@ fileclose(struct file *f)
   switch (ff.type) {
   case FD_PIPE:   pipeclose(ff.pipe, ff.writable); break;
   case FD_INODE:  iput(ff.ip); break;
-  case FD_SOCKET:
-  case FD_RFS:    sockclose(ff.off);
+  case FD_SOCKET: sockclose(ff.off); break;
+  case FD_RFS:    rfsclose(&ff);
   }
 }
 
@@ -1145,7 +1979,7 @@ int close(int fd)
 
 int fstat(int fd, struct stat *st)
 {
-  int r; struct file *f;
+  struct file *f;
   if (!(f = getf(fd)) || !mvalid(st, sizeof(struct stat))) return -1;
   switch (f->type) {
   case FD_INODE:
@@ -1154,16 +1988,16 @@ int fstat(int fd, struct stat *st)
     iunlock(f->ip);
     return 0;
  case FD_RFS:
-    r = M_FSTAT;
-    if (socktx(f->off, &r, 4) || sockrx(f->off, &r, 4) || (r == 0 && sockrx(f->off, st, sizeof(struct stat)))) return -1;
-    return r;
+    if (rfsattr(f)) return -1;
+    memcpy(st, &f->rn->a.st, sizeof(struct stat));
+    return 0;
   }
   return -1;
 }
 
 int read(int fd, char *addr, int n)
 {
-  int r; int h[2]; struct file *f;
+  int r; struct file *f;
   if (!(f = getf(fd)) || !f->readable || !mvalid(addr, n)) return -1;
   switch (f->type) {
   case FD_PIPE: return piperead(f->pipe, addr, n);
@@ -1172,20 +2006,17 @@ int read(int fd, char *addr, int n)
     return sockread(f->off, addr, n);
   case FD_INODE:
     ilock(f->ip);
-    if ((r = readi(f->ip, addr, f->off, n)) > 0) f->off += r;
+    if (f->ip->dflags & D_INDEX) r = hdirread(f->ip, addr, &f->off, n);
+    else if ((r = readi(f->ip, addr, f->off, n)) > 0) f->off += r;
     iunlock(f->ip);
     return r;
-  case FD_RFS:
-    h[0] = M_READ; // XXX lock the inode
-    h[1] = n;
-    if (socktx(f->off, h, 8) || sockrx(f->off, &r, 4) || ((uint)r <= n && sockrx(f->off, addr, r))) return -1; // XXX need to zortch the file  is this correct for zero?
-    return r;
+  case FD_RFS: return rfsread(f, addr, n);
   }
   panic("read");
 }
 int write(int fd, char *addr, int n)
 {
-  int r, h[2]; struct file *f;
+  int r; struct file *f;
   if (!(f = getf(fd)) || !f->writable || !mvalid(addr, n)) return -1;
   switch (f->type) {
   case FD_PIPE: return pipewrite(f->pipe, addr, n);
@@ -1195,18 +2026,14 @@ int write(int fd, char *addr, int n)
     if ((r = writei(f->ip, addr, f->off, n)) > 0) f->off += r;
     iunlock(f->ip);
     return r;
-  case FD_RFS:
-    h[0] = M_WRITE; // XXX lock the inode
-    h[1] = n;
-    if (socktx(f->off, h, 8) || (n > 0 && socktx(f->off, addr, n))) return -1; // XXX need to zortch the file
-    return n;
+  case FD_RFS: return rfswrite(f, addr, n);
   }
   panic("write");
 }
 
 int lseek(int fd, int offset, uint whence)
 {
-  int r, h[3]; struct file *f;
+  int r; struct file *f;
   if (!(f = getf(fd)) || whence > SEEK_END) return -1;
   switch (f->type) {
   case FD_INODE:
@@ -1219,11 +2046,12 @@ int lseek(int fd, int offset, uint whence)
     iunlock(f->ip);
     return r;
   case FD_RFS:
-    h[0] = M_SEEK;
-    h[1] = offset;
-    h[2] = whence;
-    if (socktx(f->off, h, 12) || sockrx(f->off, &r, 4)) return -1;
-    return r;
+    if (whence == SEEK_END && rfsattr(f)) return -1;
+    switch (whence) {
+    case SEEK_SET: return f->off = offset;
+    case SEEK_CUR: return f->off += offset;
+    case SEEK_END: return f->off = f->rn->a.st.st_size + offset;
+    }
   }
   return -1;
 }
@@ -1271,7 +2099,6 @@ bad:
 int unlink(char *path)
 {
   struct inode *ip, *dp;
-  struct direct de;
   char name[DIRSIZ];
   uint off;
   
@@ -1289,8 +2116,7 @@ bad:
     return -1;
   }
 
-  memset(&de, 0, sizeof(de));
-  if (writei(dp, (char *)&de, off, sizeof(de)) != sizeof(de)) panic("unlink: writei");
+  dirunlink(dp, name, off);
   if ((ip->mode & S_IFMT) == S_IFDIR) {
     dp->nlink--;
     iupdate(dp);
@@ -1304,29 +2130,17 @@ bad:
   return 0;
 }
 
-uint htonl(uint a) { return (a >> 24) | ((a >> 8) & 0xff00) | ((a << 8) & 0xff0000) | (a << 24); } // XXX eliminate
-ushort htons(ushort a) { return (a >> 8) | (a << 8); } // XXX eliminate
 int memcmp() { asm(LL,8); asm(LBL, 16); asm(LCL,24); asm(MCMP); } // XXX eliminate
 int open(char *path, int oflag) // XXX, int mode)
 {
-  int fd, r; int h[4];
+  int fd;
   struct file *f;
   struct inode *ip;
 
   if (!svalid(path)) return -1;
 //  if (!namecmp(path, "rfs.txt")) {
   if (!memcmp(path,"rfs/",4)) {
-    path += 4;
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1; // XXX reuse?
-    f = getf(fd);
-    if (sockconnect(f->off, AF_INET | (htons(5003) << 16), htonl(0x7f000001))) return -1; // XXX close?
-    f->type = FD_RFS;
-    h[0] = M_OPEN;
-    h[1] = oflag;
-    h[2] = 0; //mode;
-    h[3] = strlen(path) + 1;
-    if (socktx(f->off, h, 16) || socktx(f->off, path, h[3]) || sockrx(f->off, &r, 4) || r < 0) return -1; // XXX sockclose?
-    return fd;
+    return rfsopen(path + 4, oflag);
   } else if (oflag & O_CREAT) {
     if (!(ip = create(path, S_IFREG, 0))) return -1;
   } else {
@@ -1423,14 +2237,26 @@ int pipe(int *fd)
 }
 uint *walkpdir(uint *pd, uint va);
 
+// decimal digits of n
+utoa(char *s, uint n)
+{
+  char b[12]; int i = 0;
+  do b[i++] = '0' + n % 10; while (n /= 10);
+  while (i) *s++ = b[--i];
+  *s = 0;
+}
+
+// A program found only as path.c is compiled by running "/bin/c -k /tmp/inum version path.c args", which also
+// leaves the executable in /tmp with the source's version in its header flags.  The version is handed out when
+// exec asks and forgotten by the next write to the source, so a copy with a matching version is run directly.
 int exec(char *path, char **argv)
 {
   char *s, *last;
   uint argc, sz, sp, *stack, *pd, *oldpd, *pte;
   struct { uint magic, bss, entry, flags; } hdr;
   struct inode *ip;
-  char cpath[16];  // XXX length, safety!
-  int i, n, c;
+  char cpath[16], kpath[16], kver[12], *pre[5];  // XXX length, safety!
+  int i, n, c; uint v;
 
   if (!svalid(path)) return -1;
   for (argc = 0; ; argc++) {
@@ -1444,10 +2270,26 @@ int exec(char *path, char **argv)
     cpath[i] = '.';
     cpath[i+1] = 'c';
     cpath[i+2] = 0;
-    if (!namei(cpath)) return -1;
-    if (!(ip = namei(path = "/bin/c"))) return -1;
-    argv++;
-    argc++;
+    if (!(ip = namei(cpath))) return -1;
+    ilock(ip);
+    if (!ip->mod) ip->mod = ++modclock;
+    v = ip->mod;
+    memcpy(kpath, "/tmp/", 5);
+    utoa(kpath + 5, ip->inum);
+    iunlockput(ip);
+    if (ip = namei(kpath)) {
+      ilock(ip);
+      n = readi(ip, (char *)&hdr, 0, sizeof(hdr)) == sizeof(hdr) && hdr.flags == v;
+      iunlock(ip);
+      if (n) c = 0; else iput(ip);
+    }
+    if (c) {
+      if (!(ip = namei(path = "/bin/c"))) return -1;
+      utoa(kver, v);
+      pre[0] = path; pre[1] = "-k"; pre[2] = kpath; pre[3] = kver; pre[4] = cpath;
+      argv++;
+      argc += 4;
+    }
   }
   ilock(ip);
   pd = 0;
@@ -1482,7 +2324,7 @@ int exec(char *path, char **argv)
   // prepare stack arguments
   stack = sp += PAGE - (argc+1)*4;
   for (i=0; i<argc; i++) {
-    s = (!c || i > 1) ? *argv++ : (i ? cpath : path);
+    s = (c && i < 5) ? pre[i] : *argv++;
     n = strlen(s) + 1;
     if ((sp & (PAGE - 1)) < n) goto bad;
     sp -= n;
@@ -1722,7 +2564,7 @@ int poll(struct pollfd *pfd, uint n, int msec)
         case FD_PIPE: if (f->pipe->nwrite != f->pipe->nread || !f->pipe->writeopen) ev = POLLIN; break;
         case FD_SOCKET: if (sockpoll(f->off)) ev = POLLIN; break;
         case FD_INODE:
-          if ((f->ip->mode & S_IFMT) == S_IFCHR && f->ip->dir[0] == CONSOLE) {
+          if ((f->ip->mode & S_IFMT) == S_IFCHR && f->ip->major == CONSOLE) {
             ilock(f->ip);
             if (input.r != input.w) ev = POLLIN;
             iunlock(f->ip);
@@ -2160,6 +3002,7 @@ mainc()
   kpdir[0] = 0;          // don't need low map anymore
   consoleinit();         // console device
   ivec(alltraps);        // trap vector
+  iinit();               // inode cache
   binit();               // buffer cache
   ideinit();             // disk
   stmr(128*1024);        // set timer
@@ -21,7 +21,7 @@ enum {
   PSHG,POPG,NET1,NET2,NET3,NET4,NET5,NET6,NET7,NET8,NET9,
   POW ,ATN2,FABS,ATAN,LOG ,LOGT,EXP ,FLOR,CEIL,HYPO,SIN ,COS ,TAN ,ASIN, // math
   ACOS,SINH,COSH,TANH,SQRT,FMOD,
-  IDLE
+  IDLE,LAC ,LBC
 };
 
 // system calls